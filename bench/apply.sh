@@ -0,0 +1,49 @@
+#!/bin/sh
+# End-to-end apply latency against the session's real colord.
+# Usage: bench/apply.sh [GAMMA_TOOL] [ITERATIONS]
+#
+# Alternates between two temperatures so no run is skipped as a no-op, and
+# prints one JSON object per run on stdout, e.g.
+#   {"bench":"apply","mode":"cold","iteration":3,"us":184210}
+# "cold" runs in a fresh process; "daemon" goes through a --daemon started here.
+# Your display settings are reset with -r when the benchmark ends.
+set -u
+
+TOOL=${1:-./gamma-tool}
+ITERATIONS=${2:-10}
+
+if ! gdbus call --system --dest org.freedesktop.ColorManager \
+        --object-path /org/freedesktop/ColorManager \
+        --method org.freedesktop.DBus.Peer.Ping >/dev/null 2>&1; then
+    echo "Skipping apply benchmark: colord is not reachable on the system bus." >&2
+    exit 0
+fi
+
+# Prints the run-wide total from --timings=json.
+run_total() {
+    "$TOOL" "$@" --timings=json 2>&1 >/dev/null |
+        sed -n 's/^{"device":null,"phase":"total","us":\([0-9]*\)}$/\1/p'
+}
+
+bench_mode() {
+    mode=$1
+    shift
+    i=0
+    while [ "$i" -lt "$ITERATIONS" ]; do
+        if [ $((i % 2)) -eq 0 ]; then temp=5000; else temp=4500; fi
+        us=$(run_total "$@" -t "$temp")
+        echo "{\"bench\":\"apply\",\"mode\":\"$mode\",\"iteration\":$i,\"us\":${us:-null}}"
+        i=$((i + 1))
+    done
+}
+
+bench_mode cold --no-daemon
+
+"$TOOL" --daemon &
+DAEMON_PID=$!
+sleep 1
+bench_mode daemon
+kill "$DAEMON_PID"
+wait "$DAEMON_PID" 2>/dev/null
+
+"$TOOL" --no-daemon -r >/dev/null
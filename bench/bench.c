@@ -0,0 +1,120 @@
+// Microbenchmarks for the profile generation path.
+// Build and run with: make bench
+//
+// Prints one JSON object per line on stdout, e.g.
+//   {"bench":"compute_vcgt_ramp","samples":1024,"iterations":40960,"ns_per_op":2711.4}
+// so results can be collected and compared across commits.
+#define GAMMA_TOOL_NO_MAIN
+#include "../gamma-tool.c"
+
+#define BENCH_MIN_USEC 200000 // Run each benchmark for at least this long
+#define DEFAULT_BASE "/usr/share/color/icc/colord/sRGB.icc"
+
+static const guint bench_sizes[] = {256, 1024, 4096};
+
+typedef void (*BenchFunc)(gpointer data);
+
+/**
+ * @brief Times func, doubling the iteration count until it runs for BENCH_MIN_USEC.
+ * @return The average time per call in nanoseconds.
+ */
+static gdouble bench_run(BenchFunc func, gpointer data, guint64 *iterations) {
+    func(data); // Warm up caches and lazily filled tables
+    for (guint64 n = 1;; n *= 2) {
+        gint64 start = g_get_monotonic_time();
+        for (guint64 i = 0; i < n; i++) {
+            func(data);
+        }
+        gint64 elapsed = g_get_monotonic_time() - start;
+        if (elapsed >= BENCH_MIN_USEC) {
+            *iterations = n;
+            return elapsed * 1000.0 / n;
+        }
+    }
+}
+
+static void bench_report(const char *name, guint samples, BenchFunc func, gpointer data) {
+    guint64 iterations;
+    gdouble ns = bench_run(func, data, &iterations);
+    printf("{\"bench\":\"%s\",\"samples\":%u,\"iterations\":%" G_GUINT64_FORMAT ",\"ns_per_op\":%.1f}\n",
+           name, samples, iterations, ns);
+    fflush(stdout);
+}
+
+typedef struct {
+    VcgtRamp *ramp;
+    CdIcc *icc;
+    IccTemplate *template;
+    gint temperature;
+} BenchState;
+
+static const gfloat bench_gamma[3] = {0.9f, 0.85f, 0.8f};
+
+static void bench_compute_vcgt_ramp(gpointer data) {
+    BenchState *state = data;
+    CdColorRGB temp_color;
+    blackbody_lookup(state->temperature, &temp_color);
+    compute_vcgt_ramp(bench_gamma, &temp_color, state->ramp);
+}
+
+static void bench_generate_vcgt(gpointer data) {
+    BenchState *state = data;
+    g_free(generate_vcgt(bench_gamma, state->temperature, state->ramp->n_samples, state->icc));
+}
+
+static void bench_blackbody_lookup(gpointer data) {
+    BenchState *state = data;
+    CdColorRGB color;
+    // Sweep the range the way a transition would, crossing table cells.
+    state->temperature = state->temperature >= 6500 ? 3400 : state->temperature + 7;
+    blackbody_lookup(state->temperature, &color);
+}
+
+static void bench_serialize_profile(gpointer data) {
+    BenchState *state = data;
+    GBytes *bytes = serialize_profile(state->icc, state->ramp, NULL);
+    if (bytes) g_bytes_unref(bytes);
+}
+
+static void bench_icc_template_render(gpointer data) {
+    BenchState *state = data;
+    static const gchar uuid[] = "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef";
+    GBytes *bytes = icc_template_render(state->template, bench_gamma, state->temperature, uuid, state->ramp);
+    if (bytes) g_bytes_unref(bytes);
+}
+
+int main(int argc, char *argv[]) {
+    const char *base_path = argc > 1 ? argv[1] : DEFAULT_BASE;
+    BenchState state = {.temperature = 5000};
+
+    state.icc = cd_icc_new();
+    GFile *file = g_file_new_for_path(base_path);
+    GError *error = NULL;
+    gboolean have_base = cd_icc_load_file(state.icc, file, CD_ICC_LOAD_FLAGS_NONE, NULL, &error);
+    g_object_unref(file);
+    if (!have_base) {
+        fprintf(stderr, "Skipping ICC benchmarks, could not load %s: %s\n", base_path, error->message);
+        g_clear_error(&error);
+    }
+
+    bench_report("blackbody_lookup", 0, bench_blackbody_lookup, &state);
+    for (guint i = 0; i < G_N_ELEMENTS(bench_sizes); i++) {
+        state.temperature = 5000;
+        state.ramp = vcgt_ramp_new(bench_sizes[i]);
+        bench_report("compute_vcgt_ramp", bench_sizes[i], bench_compute_vcgt_ramp, &state);
+        if (have_base) {
+            bench_report("generate_vcgt", bench_sizes[i], bench_generate_vcgt, &state);
+            g_free(generate_vcgt(bench_gamma, state.temperature, bench_sizes[i], state.icc));
+            bench_report("serialize_profile", bench_sizes[i], bench_serialize_profile, &state);
+            state.template = icc_template_new(state.icc, bench_sizes[i], base_path, NULL, NULL);
+            if (state.template) {
+                bench_report("icc_template_render", bench_sizes[i], bench_icc_template_render, &state);
+                icc_template_free(state.template);
+            }
+        }
+        g_free(state.ramp);
+    }
+
+    g_object_unref(state.icc);
+    return 0;
+}
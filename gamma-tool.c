@@ -1,43 +1,446 @@
-// Compile with: gcc -o gamma-tool gamma-tool.c $(pkg-config --cflags --libs glib-2.0 gobject-2.0 colord gio-2.0) -lm
+// Compile with: make (or gcc -O2 -o gamma-tool gamma-tool.c $(pkg-config --cflags --libs glib-2.0 gobject-2.0 colord gio-2.0) -lm)
+#define _GNU_SOURCE  // For O_TMPFILE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>    // For pow()
-#include <unistd.h>  // For sleep()
+#include <errno.h>
+#include <math.h>    // For exp2(), log2()
+#include <unistd.h>  // For close(), unlink(), linkat()
+#include <fcntl.h>   // For open(), O_TMPFILE
+#include <sys/timerfd.h>  // For the --schedule timer
 #include <glib.h>
 #include <colord.h>
-#include <gio/gio.h> // Required for GFile
+#include <gio/gio.h> // Required for GDBus
+#include <glib-unix.h>  // For g_unix_signal_add()
+#include <signal.h>
+#include "gammatool.h"
 
-#define N_SAMPLES 256
+#define N_SAMPLES 256     // Default LUT resolution
+#define MAX_SAMPLES 65535 // The vcgt entry count is a 16-bit field
+#define VCGT_KNOT_MIN_SAMPLES 2048 // Ramps this long interpolate between knots
+#define VCGT_KNOT_MAX_SPAN 64      // Samples between two exactly computed knots
+#define VCGT_KNOT_TOLERANCE 0.1    // Interpolation error aimed for, in 16-bit steps
 #define OUR_PREFIX "gamma-tool-"
-#define TIMEOUT_SECONDS 4
+#define SLOT_PREFIX OUR_PREFIX "slot-"
+#define TIMEOUT_SECONDS 4 // Discovery budget of a run; a learned latency only extends it
+#define DISCOVERY_MAX_SECONDS 30 // Most a learned discovery budget grows to
+#define DISCOVERY_LATENCY_FACTOR 4 // Learned budget: this many times the typical discovery latency
+#define DISCOVERY_LATENCY_WEIGHT 0.25 // Weight of each new discovery in the typical latency
+#define DIRECT_COMMIT_DELAY_MS 1500 // Daemon: idle time before --direct settings are saved
+#define CACHE_MAX_PROFILES 16 // Generated profiles kept for reuse
+#define TRANSITION_MIRED_STEP 0.5 // Largest change between frames, in mired
+#define TRANSITION_MIN_FRAME_MS 50 // Frame rate cap for short transitions
+#define TRANSITION_FALLBACK_CHECKPOINT 60 // Seconds between profiles when frames can't be shown
+#define WATCH_DEBOUNCE_MS 1000 // --watch: wait this long after the last hotplug event
+#define SCHEDULE_COALESCE_SECONDS 60 // Scheduled changes this close together wake the daemon once
+#define SCHEDULE_RECHECK_SECONDS (12 * 60 * 60) // Wakeup when no event is coming, e.g. polar days
+
+#define MUTTER_DISPLAY_CONFIG_BUS "org.gnome.Mutter.DisplayConfig"
+#define MUTTER_DISPLAY_CONFIG_PATH "/org/gnome/Mutter/DisplayConfig"
+
+#define RELATIVE_GAMMA_MIN 0.1f // Relative -g never goes below this
+
+#define BLACKBODY_MIN 1000  // colord's supported range, in Kelvin
+#define BLACKBODY_MAX 25000
+#define BLACKBODY_STEP 10
+#define BLACKBODY_ENTRIES ((BLACKBODY_MAX - BLACKBODY_MIN) / BLACKBODY_STEP + 1)
+
+#define ICC_HEADER_SIZE 128
+#define ICC_TAG_ENTRY_SIZE 12
+#define ICC_SIG_VCGT 0x76636774 // 'vcgt'
+
+typedef enum {
+    TIMINGS_NONE,
+    TIMINGS_TEXT,  // --timings: a summary table on stderr
+    TIMINGS_JSON,  // --timings=json: one JSON object per line on stderr
+} TimingsFormat;
+
+#define MAX_DEVICE_SCOPES 16 // -d options in one invocation
+
+// Settings for one -d display: the -g and -t that follow it, falling back
+// to those given before the first -d.
+typedef struct {
+    gint device_index;      // -1 if the display was given by name
+    gchar device_name[256]; // Colord device ID or connector, empty if by index
+    gfloat gamma[3];
+    gint temperature;
+    gboolean gamma_relative;       // -g +D or -g -D: gamma holds deltas
+    gboolean temperature_relative; // -t +D or -t -D: temperature holds a delta
+} DeviceSettings;
 
 // A struct to hold our parsed command-line arguments
 typedef struct {
     gfloat gamma[3];
     gint temperature;
+    gboolean gamma_relative;       // -g +D or -g -D: gamma holds deltas
+    gboolean temperature_relative; // -t +D or -t -D: temperature holds a delta
     gboolean remove_profile;
     gboolean info_mode;
+    gboolean json;          // --json: -i prints one JSON document for all displays
     gint device_index; // -1 means all devices
+    gchar device_name[256]; // -d ID|CONNECTOR, empty if not given
+    DeviceSettings scopes[MAX_DEVICE_SCOPES]; // Every -d in order; with one, it is also in the fields above
+    guint n_scopes;         // 0 means all devices
+    guint n_samples;        // VCGT entries per channel
+    gboolean auto_samples;  // Match each CRTC's gamma ramp size instead
+    gboolean daemon_mode;   // --daemon: serve requests on the session bus
+    gboolean no_daemon;     // --no-daemon: never forward to a running daemon
+    gboolean slots;         // --slots: rewrite one of two stable profiles per device
+    gboolean gc_mode;       // --gc: delete gamma-tool profiles nothing is using
+    gboolean direct;        // --direct: set the CRTC gamma through Mutter, no profile
+    gboolean no_persist;    // --no-persist: never save --direct settings to colord
+    gint temperature_end;   // -t START..END: fade to this, 0 if not a transition
+    guint over_seconds;     // --over: transition length
+    guint checkpoint_seconds; // --checkpoint: also save a profile this often, 0 for ends only
+    guint timeout_seconds;  // --timeout: discovery budget of the run, 0 to learn one
+    TimingsFormat timings;
+    const char *schedule;   // --schedule SPEC: daemon temperature schedule, points into argv
+    const char *location;   // --location LAT:LON, for sunrise/sunset entries
+    gboolean watch;         // --watch: daemon that re-applies settings to hotplugged displays
+    const char *batch;      // --batch FILE|-: one command per line in one session, points into argv
+    const char *metrics;    // --metrics FILE: daemon's node_exporter textfile, points into argv
+    // Offline generation; these point into argv.
+    const char *generate_base;   // --generate BASE.icc: no colord, just write a profile
+    const char *generate_batch;  // --generate-batch FILE|-: one --generate line each
+    const char *output_path;     // -o OUT|-, default stdout
 } AppArgs;
 
+// A gamma ramp in structure-of-arrays layout, quantized to 16 bits the way
+// lcms2 writes a vcgt table. The three channels are stored back to back, red
+// then green then blue, which is the order of both the vcgt tag and
+// SetCrtcGamma, so either takes data as it is.
+typedef struct {
+    guint n_samples;
+    guint16 *r, *g, *b; // Point into data
+    guint16 data[];     // 3 * n_samples values
+} VcgtRamp;
+
+// Placeholder fields of an IccTemplate, patched per profile.
+typedef enum {
+    TEMPLATE_DESCRIPTION,
+    TEMPLATE_UUID,
+    TEMPLATE_GAMMA,
+    TEMPLATE_TEMPERATURE,
+    TEMPLATE_N_FIELDS
+} TemplateField;
+
+typedef struct {
+    gsize offset;
+    gboolean utf16;  // UTF-16BE (dict and mluc strings) rather than ASCII
+} TemplateSlot;
+
+// A base profile serialized once with an n_samples vcgt and fixed-width
+// placeholder metadata, so each profile derived from it is a copy plus patches.
+typedef struct {
+    GBytes *data;
+    guint n_samples;
+    gsize vcgt_data;  // Offset of the first vcgt entry
+    GArray *slots[TEMPLATE_N_FIELDS];  // TemplateSlot, every occurrence of each field
+} IccTemplate;
+
+#define STATS_N_BUCKETS 11
+
+// Histogram bucket bounds in seconds, from a fast cached apply to a discovery timeout.
+static const gdouble stats_buckets[STATS_N_BUCKETS] = {0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+typedef struct {
+    guint64 counts[STATS_N_BUCKETS];  // Observations in each bucket alone, not cumulative
+    guint64 count;
+    gdouble sum;  // Seconds
+} StatsHistogram;
+
+// Counters since the session started, for --metrics and the daemon's Stats property.
+typedef struct {
+    StatsHistogram apply_seconds;      // Whole apply runs
+    StatsHistogram discovery_seconds;  // Each wait for colord to detect a new profile, timeouts included
+    guint64 cache_hits;      // Content-addressed profile already on disk
+    guint64 cache_misses;    // ... or generated afresh
+    guint64 noop_skips;      // Display already had the requested profile
+    guint64 gc_files;        // Profiles deleted by the LRU or --gc
+    guint64 colord_errors;   // Failed colord calls in apply and remove pipelines, discovery timeouts
+} Stats;
+
+// Long-lived colord state. A one-shot invocation creates one session for a
+// single run; --daemon keeps it warm so later requests skip the cold start.
+typedef struct {
+    CdClient *client;
+    GList *devices;           // Connected display devices, valid if devices_valid
+    gboolean devices_valid;   // Cleared when colord adds or removes a device
+    GHashTable *profiles;     // Object path -> connected CdProfile
+    GHashTable *base_icc;     // Base profile filename -> parsed CdIcc
+    GHashTable *templates;    // "base checksum|n_samples" -> IccTemplate
+    GList *discovering;       // Apply jobs waiting for colord to see their file
+    gulong profile_added_id;  // CdClient::profile-added handler, if connected
+    GHashTable *direct_settings;  // Device ID -> DirectSettings, for relative -g/-t
+    gint64 discovery_latency; // Typical discovery wait in microseconds, 0 if none was learned
+    gboolean discovery_latency_loaded;  // discovery_latency was read from the cache dir
+    GDBusConnection *bus;       // Session bus, for Mutter's DisplayConfig; NULL until needed
+    guint monitors_changed_id;  // DisplayConfig::MonitorsChanged subscription on bus
+    GHashTable *crtcs;          // Connector name -> CrtcInfo, NULL until queried or after MonitorsChanged
+    Stats stats;
+} Session;
+
+// Settings last set on a display with --direct, which no profile records yet.
+typedef struct {
+    gfloat gamma[3];
+    gint temperature;
+    gchar *profile_path;  // Object path of the device's default profile at the time
+} DirectSettings;
+
+// A lit output's CRTC as reported by Mutter's DisplayConfig.
+typedef struct {
+    guint serial;      // DisplayConfig serial the IDs belong to
+    guint crtc;
+    guint gamma_size;  // Entries per channel in the CRTC's gamma ramp
+} CrtcInfo;
+
+typedef struct _RunContext RunContext;
+typedef void (*RunDoneFunc)(RunContext *run, gpointer user_data);
+
+// Shared state for one run of the async engine. Every device pipeline is
+// started up front and `done` is called once the last one has finished.
+struct _RunContext {
+    Session *session;
+    AppArgs args;
+    GPtrArray *jobs;  // DeviceJob*, kept in device order for output
+    guint pending;    // Jobs that have not called job_finish() yet
+    GHashTable *crtcs;  // -n auto, --direct, transitions: connector name -> CrtcInfo
+    GPtrArray *devices; // Connected CdDevice to process instead of -d or all, e.g. for --watch
+    GHashTable *shared_profiles;  // Apply: new_path -> SharedProfile, so each file is made once
+    guint preparing;        // Apply jobs that haven't reached the commit point or dropped out
+    GPtrArray *prepared;    // DeviceJob* whose new profile is attached and ready to become the default
+    gboolean prepare_failed;  // A job failed before the commit point; roll every display back
+    GString *output;  // Run-level messages for stdout, before the devices'
+    GString *errors;  // Run-level messages for stderr
+    gint status;      // Process exit status for this run
+    gint64 start_time;  // Monotonic, for the run's total
+    gint64 discovery_deadline;  // Monotonic; every discovery wait of the run ends by then, 0 before the first
+    guint discovering;          // Jobs of this run waiting for discovery
+    gint64 discovery_since;     // Monotonic start of the current stretch with discovering > 0
+    gint64 discovery_usec;      // Time some job of the run spent waiting, for --timings
+    gboolean discovery_learned; // A wait ended, so the session's latency should be saved
+    GString *timings;   // Per-phase records, appended to errors when done
+    RunDoneFunc done;
+    gpointer done_data;
+};
+
+// libgammatool's context (gammatool.h): a session plus a queue of requests,
+// run one at a time like the daemon's.
+struct _GammaToolContext {
+    Session *session;
+    GQueue tasks;          // GTask per request; the head is running if current is set
+    RunContext *current;
+    gint64 connect_start;  // For the first run's colord-connect timing, then 0
+    gint64 connect_usec;
+};
+
+// Per-device pipeline state, carried through the colord async callbacks.
+typedef struct {
+    RunContext *run;
+    AppArgs args;           // The run's arguments, with this device's -d settings
+    CdDevice *device;
+    CdProfile *profile;     // The device's current default profile
+    CdProfile *new_profile; // Apply mode: the profile we generated
+    gchar *new_path;
+    gchar *cache_key;       // Apply mode: content address of new_path
+    guint n_samples;        // Apply mode: LUT resolution for this device
+    gboolean is_our_profile;
+    gboolean delete_removed;  // Delete the file of the profile we detach
+    gboolean in_transaction;  // Apply: counted in run->preparing until prepared or done
+    gboolean prepared;      // Apply: waiting in run->prepared for the commit
+    gboolean added_profile; // Apply: we attached new_profile, so a rollback detaches it
+    guint timeout_id;       // Discovery timeout while waiting for colord
+    gint64 discovery_start; // Monotonic start of the discovery wait
+    gint64 start_time;      // Monotonic, for the job's total
+    gint64 phase_start;     // Monotonic end of the previous phase
+    GString *output;        // Buffered so concurrent devices don't interleave
+} DeviceJob;
+
+typedef enum {
+    SCHEDULE_TIME,     // Local wall-clock time
+    SCHEDULE_SUNRISE,  // Relative to sunrise at --location
+    SCHEDULE_SUNSET,
+} ScheduleKind;
+
+// One --schedule entry: at that time of day, switch to `temperature`.
+typedef struct {
+    ScheduleKind kind;
+    gint seconds;      // Seconds after midnight, or the offset from sunrise/sunset
+    gint temperature;
+} ScheduleEvent;
+
+typedef struct _Transition Transition;
+typedef void (*TransitionDoneFunc)(Transition *transition, gpointer user_data);
+
+// A fade from args.temperature to args.temperature_end. The two ends and any
+// checkpoints are applied as profiles by ordinary runs; the frames in between
+// are computed as they fall due and sent straight to the CRTCs, so nothing is written.
+struct _Transition {
+    Session *session;
+    AppArgs args;
+    GDBusConnection *bus;   // For SetCrtcGamma, NULL if there are no targets
+    GHashTable *crtcs;      // Connector name -> CrtcInfo, taken over from the first run
+    GPtrArray *targets;     // const CrtcInfo*, the lit CRTCs of the selected displays
+    GHashTable *ramps;      // Gamma size -> VcgtRamp, refilled for each frame
+    gint *temperatures;     // Temperature of each frame
+    guint n_frames;         // Frame 0 is the start, frame n_frames - 1 the end
+    guint frame;            // Last frame shown
+    gint64 start_time;      // Monotonic time of frame 0
+    gint64 duration;        // Microseconds from frame 0 to the last frame
+    gint64 next_checkpoint; // Monotonic, 0 if there are no checkpoints
+    guint timeout_id;
+    RunContext *run;        // Profile run in flight, if any
+    gint status;
+    gboolean finished;
+    RunDoneFunc report;     // Called with each profile run before it is freed
+    TransitionDoneFunc done;
+    gpointer user_data;
+};
+
+// Displays of one run that need the same profile (same base and settings).
+// The leader generates, writes and registers it; the others wait and then
+// just attach the leader's CdProfile.
+typedef struct {
+    DeviceJob *leader;
+    GPtrArray *waiting;  // DeviceJob*
+} SharedProfile;
+
+// --watch: what a run last applied to one display.
+typedef struct {
+    gfloat gamma[3];
+    gint temperature;
+} WatchTarget;
+
+// State for --daemon: requests are queued and run one at a time against a
+// single warm session, so two requests never race on the same device.
+typedef struct {
+    Session *session;
+    GMainLoop *loop;
+    GQueue requests;        // Pending GDBusMethodInvocation*
+    RunContext *current;    // The request being served, if any
+    gboolean current_is_internal;  // current is a --direct commit or a scheduled change, not a request
+    GDBusNodeInfo *introspection;
+    guint commit_id;        // Pending --direct commit timer
+    gboolean commit_due;    // The commit should run as soon as nothing else is
+    gboolean quitting;      // Quit once the due commit has run
+    AppArgs commit_args;    // Settings of the last --direct request
+    GArray *schedule;       // ScheduleEvent, from --schedule; NULL without one
+    gdouble latitude, longitude;  // --location, for sunrise and sunset
+    AppArgs schedule_args;  // The daemon's own settings; temperature comes from the schedule
+    AppArgs settings;       // --watch: what hotplugged displays get, from the last all-display change
+    gboolean have_settings; // FALSE until something was applied, or after -r
+    GHashTable *watch_pending;  // Object path -> CdDevice added or changed since the last watch run
+    GHashTable *watch_targets;  // Device ID -> WatchTarget applied since settings last changed
+    guint watch_id;         // Debounce timer for watch_pending
+    gboolean watch_due;     // watch_pending should be processed as soon as nothing else runs
+    gboolean schedule_due;  // A scheduled change should run as soon as nothing else is
+    int timer_fd;           // CLOCK_REALTIME timerfd for the next event, -1 if unavailable
+    guint timer_id;         // Source watching timer_fd, or a plain timeout without one
+    const char *metrics;    // --metrics FILE, rewritten after each run; NULL without one
+} Daemon;
+
+#define DAEMON_BUS_NAME "io.github.chisight.GammaTool"
+#define DAEMON_OBJECT_PATH "/io/github/chisight/GammaTool"
+
+static const gchar daemon_introspection_xml[] =
+    "<node>"
+    "  <interface name='" DAEMON_BUS_NAME "'>"
+    "    <method name='Run'>"
+    "      <arg type='as' name='arguments' direction='in'/>"
+    "      <arg type='i' name='status' direction='out'/>"
+    "      <arg type='s' name='output' direction='out'/>"
+    "      <arg type='s' name='errors' direction='out'/>"
+    "    </method>"
+    "    <property name='Stats' type='a{sd}' access='read'>"
+    "      <annotation name='org.freedesktop.DBus.Property.EmitsChangedSignal' value='false'/>"
+    "    </property>"
+    "  </interface>"
+    "</node>";
+
 // --- Forward Declarations of Helper Functions ---
-static void parse_arguments(int argc, char *argv[], AppArgs *args);
+static gboolean parse_arguments(int argc, char *argv[], AppArgs *args, GError **error);
+static void print_usage(const char *prog);
 static GList *get_display_devices(CdClient *client);
-static void process_device(CdClient *client, CdDevice *device, AppArgs *args);
-static void handle_info_mode(CdDevice *device, CdProfile *profile);
-static void handle_remove_mode(CdDevice *device, CdProfile *profile);
-static void handle_apply_mode(CdClient *client, CdDevice *device, CdProfile *profile, AppArgs *args);
-static void generate_vcgt(gfloat gamma[3], gint color_temperature, CdIcc *profile_data);
-static CdProfile *create_and_set_sRGB_profile(CdClient *client, CdDevice *device);
+static CdDevice *session_find_device(Session *session, const char *name, GError **error);
+static Session *session_new(GError **error);
+static void session_free(Session *session);
+static RunContext *run_new(Session *session, const AppArgs *args, RunDoneFunc done, gpointer done_data);
+static void run_start(RunContext *run);
+static void run_free(RunContext *run);
+static gchar *run_get_output(RunContext *run);
+static void process_device(RunContext *run, CdDevice *device, const DeviceSettings *settings);
+static void dispatch_mode(DeviceJob *job);
+static void handle_info_mode(DeviceJob *job);
+static void handle_remove_mode(DeviceJob *job);
+static void handle_apply_mode(DeviceJob *job);
+static void handle_direct_mode(DeviceJob *job);
+static void register_new_profile(DeviceJob *job);
+static void run_release_shared_profile(DeviceJob *job);
+static gboolean profile_get_settings(CdProfile *profile, gfloat gamma[3], gint *temperature, guint *n_samples);
+static VcgtRamp *generate_vcgt(const gfloat gamma[3], gint color_temperature, guint n_samples, CdIcc *profile_data);
+static void blackbody_lookup(gdouble temperature, CdColorRGB *result);
+static VcgtRamp *vcgt_compute(const gfloat gamma[3], gint color_temperature, guint n_samples);
+static gboolean set_vcgt_from_ramp(CdIcc *profile_data, const VcgtRamp *ramp, GError **error);
+static gboolean write_profile(GBytes *data, const gchar *path, gboolean in_place, GError **error);
+static IccTemplate *icc_template_new(CdIcc *profile_data, guint n_samples, const char *base, const char *base_checksum, GError **error);
+static GBytes *icc_template_render(const IccTemplate *template, const gfloat gamma[3], gint temperature,
+                                   const char *uuid, const VcgtRamp *ramp);
+static void icc_template_free(IccTemplate *template);
+static GHashTable *session_get_crtcs(Session *session);
+static void create_and_set_sRGB_profile(DeviceJob *job);
+static void job_printf(DeviceJob *job, const char *format, ...) G_GNUC_PRINTF(2, 3);
+static void job_error(DeviceJob *job, const char *format, ...) G_GNUC_PRINTF(2, 3);
+static void job_finish(DeviceJob *job);
+static void job_phase(DeviceJob *job, const char *phase);
+static void run_add_timing(RunContext *run, const char *device, const char *phase, gint64 usec);
+static void device_job_free(DeviceJob *job);
+static gchar *profile_cache_key(const char *base_checksum, const gfloat gamma[3], gint temperature, guint n_samples);
+static gboolean profile_cache_contains(const char *path);
+static void profile_cache_touch(const char *path);
+static void profile_cache_prune(Session *session);
+static void discovery_latency_save(Session *session);
+static void stats_observe(StatsHistogram *histogram, gint64 usec);
+static void run_gc(RunContext *run);
+static gchar *slot_sibling_path(const char *slot_path);
+static int run_generate(const AppArgs *args);
+static gboolean args_is_apply(const AppArgs *args);
+static void set_profile_metadata(CdIcc *profile_data, const AppArgs *args, guint n_samples,
+                                 const char *base, const char *base_checksum, const char *uuid);
+static GBytes *serialize_profile(CdIcc *profile_data, const VcgtRamp *ramp, GError **error);
+static Transition *transition_new(Session *session, const AppArgs *args, RunDoneFunc report,
+                                  TransitionDoneFunc done, gpointer user_data);
+static void transition_start(Transition *transition);
+static void transition_free(Transition *transition);
+static gboolean run_free_idle(gpointer user_data);
+static int run_batch(Session *session, const AppArgs *args, GMainLoop *loop);
+static int run_daemon(const AppArgs *args);
+static gboolean forward_to_daemon(int argc, char *argv[], gint *status);
+
+static void on_cli_run_done(RunContext *run, gpointer user_data) {
+    g_main_loop_quit(user_data);
+}
 
+#ifndef GAMMA_TOOL_NO_MAIN // The benchmarks include this file for its static functions
+static void on_cli_transition_report(RunContext *run, gpointer user_data) {
+    gchar *output = run_get_output(run);
+    fputs(output, stdout);
+    fputs(run->errors->str, stderr);
+    fflush(stdout);
+    g_free(output);
+}
+
+static void on_cli_transition_done(Transition *transition, gpointer user_data) {
+    g_main_loop_quit(user_data);
+}
 
 /**
  * @brief The main entry point of the gamma-tool program.
  *
  * Orchestrates the entire process: parses arguments, connects to the colord service,
  * discovers all display devices, and then either processes a single targeted device
- * or all of them based on user input.
+ * or all of them based on user input. Each device runs through its own async
+ * pipeline, so the total time is that of the slowest monitor rather than the sum.
+ * If a gamma-tool daemon is running, the request is handed to it instead.
  *
  * @param argc The number of command-line arguments.
  * @param argv An array of command-line argument strings.
@@ -45,73 +448,329 @@ static CdProfile *create_and_set_sRGB_profile(CdClient *client, CdDevice *device
  */
 int main(int argc, char *argv[]) {
     AppArgs args;
-    parse_arguments(argc, argv, &args);
+    GError *error = NULL;
+    if (!parse_arguments(argc, argv, &args, &error)) {
+        if (error) {
+            fprintf(stderr, "Error: %s\n", error->message);
+            g_error_free(error);
+        } else {
+            print_usage(argv[0]);
+        }
+        return 1;
+    }
+
+    if (args.generate_base || args.generate_batch) {
+        return run_generate(&args);
+    }
+    if (args.daemon_mode) {
+        return run_daemon(&args);
+    }
+    gint status;
+    // A transition keeps running for its whole length, so it stays in this
+    // process instead of holding up the daemon's queue. A batch reads its
+    // commands here and already shares one session.
+    if (!args.no_daemon && args.temperature_end == 0 && !args.batch && forward_to_daemon(argc, argv, &status)) {
+        return status;
+    }
 
     // --- Colord Client Setup ---
-    GError *error = NULL;
-    CdClient *client = cd_client_new();
-    if (!cd_client_connect_sync(client, NULL, &error)) {
+    GammaToolContext *context = gamma_tool_context_new(&error);
+    if (!context) {
         g_critical("Failed to connect to colord: %s", error->message);
         g_error_free(error);
-        g_object_unref(client);
         return 1;
     }
 
-    // --- Discover Devices ---
-    GList *display_devices = get_display_devices(client);
-    if (!display_devices) {
-        printf("No display devices found.\n");
-        g_object_unref(client);
-        return 0;
+    // Batches and transitions aren't part of the library; they use its session directly.
+    if (args.batch || args.temperature_end > 0) {
+        GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+        if (args.batch) {
+            status = run_batch(context->session, &args, loop);
+        } else {
+            Transition *transition = transition_new(context->session, &args, on_cli_transition_report,
+                                                    on_cli_transition_done, loop);
+            transition_start(transition);
+            if (!transition->finished) {
+                g_main_loop_run(loop);
+            }
+            status = transition->status;
+            transition_free(transition);
+        }
+        g_main_loop_unref(loop);
+        gamma_tool_context_free(context);
+        return status;
     }
 
     // --- Process Device(s) ---
-    if (args.device_index != -1) {
-        // Single device mode
-        guint num_devices = g_list_length(display_devices);
-        if (args.device_index >= (gint)num_devices) {
-            fprintf(stderr, "Error: Invalid device index %d. Only %u devices found (0 to %u).\n",
-                    args.device_index, num_devices, num_devices > 0 ? num_devices - 1 : 0);
-            g_list_free_full(display_devices, g_object_unref);
-            g_object_unref(client);
-            return 1;
-        }
-        CdDevice *device = g_list_nth_data(display_devices, args.device_index);
-        process_device(client, device, &args);
+    GammaToolResult *result = gamma_tool_run_sync(context, (const gchar *const *)argv + 1, NULL, &error);
+    if (result) {
+        fputs(result->output, stdout);
+        fputs(result->errors, stderr);
+        status = result->status;
+        gamma_tool_result_free(result);
     } else {
-        // All devices mode
-        for (GList *l = display_devices; l != NULL; l = l->next) {
-            CdDevice *device = l->data;
-            process_device(client, device, &args);
+        fprintf(stderr, "Error: %s\n", error->message);
+        g_error_free(error);
+        status = 1;
+    }
+    gamma_tool_context_free(context);
+    return status;
+}
+#endif
+
+/**
+ * @brief Prints the command line help.
+ */
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d INDEX|ID|CONNECTOR] [-g R:G:B|G] [-t TEMP|START..END --over DURATION] [-n SIZE|auto] [--slots] [--timeout DURATION] [--timings[=json]] [--direct [--no-persist]] [-r] [-i [--json]] [--gc]\n", prog);
+    fprintf(stderr, "  -d INDEX       Target a specific display index (e.g., 0),\n");
+    fprintf(stderr, "                 colord device ID or connector name (e.g., DP-1). Repeat for\n");
+    fprintf(stderr, "                 per-display settings: -g and -t after a -d apply to it only.\n");
+    fprintf(stderr, "  -g GAMMA       Target gamma (e.g., 0.8), 1.0 is neutral.\n");
+    fprintf(stderr, "  -t TEMPERATURE Target color temperature, 6500 is neutral.\n");
+    fprintf(stderr, "                 With a leading + or -, -g and -t change the current value (e.g. -t -200).\n");
+    fprintf(stderr, "  -t START..END --over DURATION [--checkpoint DURATION]\n");
+    fprintf(stderr, "                 Fade between two temperatures (e.g. -t 6500..3400 --over 30m),\n");
+    fprintf(stderr, "                 saving a profile at the ends and at every checkpoint.\n");
+    fprintf(stderr, "  -n SIZE|auto   Gamma table entries (default %d); auto matches the CRTC.\n", N_SAMPLES);
+    fprintf(stderr, "  --slots        Alternate between two profiles per display, rewritten in place.\n");
+    fprintf(stderr, "  -r             Remove existing profile created by this tool.\n");
+    fprintf(stderr, "  -i             Display info about the current profile.\n");
+    fprintf(stderr, "  --json         With -i, print one JSON document for all displays, from colord's\n");
+    fprintf(stderr, "                 properties only.\n");
+    fprintf(stderr, "  --gc           Delete gamma-tool profiles no display is using.\n");
+    fprintf(stderr, "  --direct       Set the gamma ramp through Mutter immediately, without a profile.\n");
+    fprintf(stderr, "                 A daemon saves it as a profile once adjustments stop.\n");
+    fprintf(stderr, "  --no-persist   With --direct, never save the settings as a profile.\n");
+    fprintf(stderr, "  --timeout DURATION\n");
+    fprintf(stderr, "                 How long colord may take to detect new profiles, for all displays\n");
+    fprintf(stderr, "                 together (default %ds, longer if colord was slow in earlier runs).\n", TIMEOUT_SECONDS);
+    fprintf(stderr, "  --timings[=json] Report how long each phase took, per device, on stderr.\n");
+    fprintf(stderr, "  --generate BASE.icc [-o OUT|-]\n");
+    fprintf(stderr, "                 Write a profile derived from BASE.icc without colord (stdout by default).\n");
+    fprintf(stderr, "  --generate-batch FILE|-\n");
+    fprintf(stderr, "                 Run one --generate command per line of FILE or stdin.\n");
+    fprintf(stderr, "  --batch FILE|- Run one command per line of FILE or stdin, sharing one colord connection.\n");
+    fprintf(stderr, "  --daemon       Keep colord state warm and serve requests on the session bus.\n");
+    fprintf(stderr, "  --watch        Run as a daemon that re-applies the settings to displays as they are plugged in.\n");
+    fprintf(stderr, "  --metrics FILE With --daemon, keep FILE up to date with counters in the Prometheus\n");
+    fprintf(stderr, "                 text format, e.g. for node_exporter's textfile collector.\n");
+    fprintf(stderr, "  --schedule 'WHEN=TEMP,...' [--location LAT:LON]\n");
+    fprintf(stderr, "                 With --daemon, change the temperature at each WHEN: HH:MM, sunrise\n");
+    fprintf(stderr, "                 or sunset, optionally offset (e.g. sunset-30m=4500,sunset=3400,sunrise=6500).\n");
+    fprintf(stderr, "  --no-daemon    Don't hand the request to a running daemon.\n");
+}
+
+/**
+ * @brief Returns TRUE if a -g or -t value is a delta, i.e. starts with + or -.
+ */
+static gboolean is_relative(const char *str) {
+    return str && (str[0] == '+' || str[0] == '-');
+}
+
+/**
+ * @brief Returns TRUE if any -g or -t of the request is a delta.
+ */
+static gboolean args_is_relative(const AppArgs *args) {
+    if (args->gamma_relative || args->temperature_relative) {
+        return TRUE;
+    }
+    for (guint i = 0; i < args->n_scopes; i++) {
+        if (args->scopes[i].gamma_relative || args->scopes[i].temperature_relative) {
+            return TRUE;
         }
     }
+    return FALSE;
+}
 
-    // --- Final Cleanup ---
-    g_list_free_full(display_devices, g_object_unref);
-    g_object_unref(client);
+/**
+ * @brief Parses -g GAMMA: a single value for all channels, or R:G:B.
+ *
+ * Anything else leaves gamma unchanged.
+ */
+static void parse_gamma(const char *str, gfloat gamma[3]) {
+    gchar **parts = g_strsplit(str, ":", 3);
+    if (parts[0] && !parts[1]) {
+        gfloat val = g_ascii_strtod(parts[0], NULL);
+        gamma[0] = val; gamma[1] = val; gamma[2] = val;
+    } else if (parts[0] && parts[1] && parts[2]) {
+        gamma[0] = g_ascii_strtod(parts[0], NULL);
+        gamma[1] = g_ascii_strtod(parts[1], NULL);
+        gamma[2] = g_ascii_strtod(parts[2], NULL);
+    }
+    g_strfreev(parts);
+}
 
-    return 0;
+/**
+ * @brief Tells whether -g GAMMA holds deltas, which R:G:B must give for all channels or none.
+ * @return FALSE with error set if absolute and relative channels are mixed.
+ */
+static gboolean gamma_is_relative(const char *str, gboolean *relative, GError **error) {
+    gchar **parts = g_strsplit(str, ":", 3);
+    guint n_relative = 0;
+    for (guint i = 0; parts[i]; i++) {
+        if (is_relative(parts[i])) n_relative++;
+    }
+    gboolean ok = n_relative == 0 || n_relative == g_strv_length(parts);
+    if (!ok) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                    "-g %s mixes absolute and relative values; give every channel a sign (e.g. +0.1:+0:-0.1) or none.", str);
+    }
+    *relative = n_relative > 0;
+    g_strfreev(parts);
+    return ok;
+}
+
+/**
+ * @brief Parses a duration such as "45", "90s", "30m" or "2h" into seconds.
+ * @return FALSE unless the whole string is a positive duration.
+ */
+static gboolean parse_duration(const char *str, guint *seconds) {
+    gchar *end;
+    guint64 value = g_ascii_strtoull(str, &end, 10);
+    guint64 unit = 1;
+    if (end == str) {
+        return FALSE;
+    }
+    if (*end == 'm') {
+        unit = 60;
+        end++;
+    } else if (*end == 'h') {
+        unit = 60 * 60;
+        end++;
+    } else if (*end == 's') {
+        end++;
+    }
+    if (*end != '\0' || value == 0 || value > G_MAXUINT / unit) {
+        return FALSE;
+    }
+    *seconds = value * unit;
+    return TRUE;
 }
 
 /**
  * @brief Parses command line arguments and populates the AppArgs struct.
- * Exits if arguments are invalid or if help is requested.
+ * @return FALSE if the arguments are invalid (error is set) or if there are
+ *         none, in which case the caller should print the usage.
  */
-static void parse_arguments(int argc, char *argv[], AppArgs *args) {
+static gboolean parse_arguments(int argc, char *argv[], AppArgs *args, GError **error) {
     *args = (AppArgs){
         .gamma = {1.0f, 1.0f, 1.0f},
         .temperature = 6500,
         .remove_profile = FALSE,
         .info_mode = FALSE,
         .device_index = -1, // Default to all devices
+        .n_scopes = 0,
+        .n_samples = N_SAMPLES,
+        .auto_samples = FALSE,
+        .daemon_mode = FALSE,
+        .no_daemon = FALSE,
+        .slots = FALSE,
+        .gc_mode = FALSE,
+        .direct = FALSE,
+        .no_persist = FALSE,
+        .temperature_end = 0,
+        .over_seconds = 0,
+        .checkpoint_seconds = 0,
+        .timeout_seconds = 0,
+        .timings = TIMINGS_NONE,
+        .schedule = NULL,
+        .location = NULL,
+        .watch = FALSE,
+        .batch = NULL,
+        .metrics = NULL,
+        .generate_base = NULL,
+        .generate_batch = NULL,
+        .output_path = "-",
     };
     const char *gamma_str = "1.0";
+    // -g and -t after a -d apply to that display only.
+    DeviceSettings *scope = NULL;
+    const char *scope_gamma_str[MAX_DEVICE_SCOPES] = { NULL };
+    gboolean scope_has_temperature[MAX_DEVICE_SCOPES] = { FALSE };
 
     for (int i = 1; i < argc; ++i) {
-        if (g_strcmp0(argv[i], "-r") == 0) {
+        if (g_strcmp0(argv[i], "--daemon") == 0) {
+            args->daemon_mode = TRUE;
+        } else if (g_strcmp0(argv[i], "--no-daemon") == 0) {
+            args->no_daemon = TRUE;
+        } else if (g_strcmp0(argv[i], "--slots") == 0) {
+            args->slots = TRUE;
+        } else if (g_strcmp0(argv[i], "--gc") == 0) {
+            args->gc_mode = TRUE;
+        } else if (g_strcmp0(argv[i], "--direct") == 0) {
+            args->direct = TRUE;
+        } else if (g_strcmp0(argv[i], "--no-persist") == 0) {
+            args->no_persist = TRUE;
+        } else if (g_str_has_prefix(argv[i], "--over") || g_str_has_prefix(argv[i], "--checkpoint")) {
+            gboolean over = g_str_has_prefix(argv[i], "--over");
+            const char *option = over ? "--over" : "--checkpoint";
+            const char *duration_str = NULL;
+            if (g_strcmp0(argv[i], option) == 0 && (i + 1) < argc) {
+                duration_str = argv[++i];
+            } else if (argv[i][strlen(option)] == '=') {
+                duration_str = argv[i] + strlen(option) + 1; // Skip "OPTION="
+            }
+            if (!duration_str || !parse_duration(duration_str, over ? &args->over_seconds : &args->checkpoint_seconds)) {
+                g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                            "%s needs a duration such as 90s, 30m or 2h.", option);
+                return FALSE;
+            }
+        } else if (g_str_has_prefix(argv[i], "--timeout")) {
+            const char *duration_str = NULL;
+            if (g_strcmp0(argv[i], "--timeout") == 0 && (i + 1) < argc) {
+                duration_str = argv[++i];
+            } else if (g_str_has_prefix(argv[i], "--timeout=")) {
+                duration_str = argv[i] + 10; // Skip "--timeout="
+            }
+            if (!duration_str || !parse_duration(duration_str, &args->timeout_seconds)) {
+                g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                            "--timeout needs a duration such as 10s or 2m.");
+                return FALSE;
+            }
+        } else if (g_strcmp0(argv[i], "--timings") == 0 || g_strcmp0(argv[i], "--timings=text") == 0) {
+            args->timings = TIMINGS_TEXT;
+        } else if (g_strcmp0(argv[i], "--timings=json") == 0) {
+            args->timings = TIMINGS_JSON;
+        } else if (g_strcmp0(argv[i], "--watch") == 0) {
+            args->watch = TRUE;
+            args->daemon_mode = TRUE; // Watching only makes sense in a long-lived process
+        } else if (g_strcmp0(argv[i], "--batch") == 0 && (i + 1) < argc) {
+            args->batch = argv[++i];
+        } else if (g_str_has_prefix(argv[i], "--batch=")) {
+            args->batch = argv[i] + 8; // Skip "--batch="
+        } else if (g_strcmp0(argv[i], "--metrics") == 0 && (i + 1) < argc) {
+            args->metrics = argv[++i];
+        } else if (g_str_has_prefix(argv[i], "--metrics=")) {
+            args->metrics = argv[i] + 10; // Skip "--metrics="
+        } else if (g_strcmp0(argv[i], "--schedule") == 0 && (i + 1) < argc) {
+            args->schedule = argv[++i];
+        } else if (g_str_has_prefix(argv[i], "--schedule=")) {
+            args->schedule = argv[i] + 11; // Skip "--schedule="
+        } else if (g_strcmp0(argv[i], "--location") == 0 && (i + 1) < argc) {
+            args->location = argv[++i];
+        } else if (g_str_has_prefix(argv[i], "--location=")) {
+            args->location = argv[i] + 11; // Skip "--location="
+        } else if (g_strcmp0(argv[i], "--generate") == 0 && (i + 1) < argc) {
+            args->generate_base = argv[++i];
+        } else if (g_str_has_prefix(argv[i], "--generate=")) {
+            args->generate_base = argv[i] + 11; // Skip "--generate="
+        } else if (g_strcmp0(argv[i], "--generate-batch") == 0 && (i + 1) < argc) {
+            args->generate_batch = argv[++i];
+        } else if (g_str_has_prefix(argv[i], "--generate-batch=")) {
+            args->generate_batch = argv[i] + 17; // Skip "--generate-batch="
+        } else if (g_str_has_prefix(argv[i], "-o")) {
+            if (g_strcmp0(argv[i], "-o") == 0 && (i + 1) < argc) {
+                args->output_path = argv[++i];
+            } else if (g_str_has_prefix(argv[i], "-o=")) {
+                args->output_path = argv[i] + 3; // Skip "-o="
+            }
+        } else if (g_strcmp0(argv[i], "-r") == 0) {
             args->remove_profile = TRUE;
         } else if (g_strcmp0(argv[i], "-i") == 0) {
             args->info_mode = TRUE;
+        } else if (g_strcmp0(argv[i], "--json") == 0) {
+            args->json = TRUE;
         } else if (g_str_has_prefix(argv[i], "-d")) {
             const char* device_idx_str = NULL;
             if (g_strcmp0(argv[i], "-d") == 0 && (i + 1) < argc) {
@@ -119,14 +778,30 @@ static void parse_arguments(int argc, char *argv[], AppArgs *args) {
             } else if (g_str_has_prefix(argv[i], "-d=")) {
                 device_idx_str = argv[i] + 3; // Skip "-d="
             }
+            if (device_idx_str && args->n_scopes == MAX_DEVICE_SCOPES) {
+                g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                            "At most %d displays can be given with -d.", MAX_DEVICE_SCOPES);
+                return FALSE;
+            }
             if (device_idx_str) {
-                 args->device_index = atoi(device_idx_str);
+                scope = &args->scopes[args->n_scopes++];
+                *scope = (DeviceSettings){ .device_index = -1 };
+            }
+            if (device_idx_str && *device_idx_str && strspn(device_idx_str, "0123456789") == strlen(device_idx_str)) {
+                 scope->device_index = atoi(device_idx_str);
+            } else if (device_idx_str) {
+                // Not a number: a colord device ID or a connector name such as DP-1.
+                if (g_strlcpy(scope->device_name, device_idx_str, sizeof(scope->device_name)) >= sizeof(scope->device_name)) {
+                    g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Device name is too long.");
+                    return FALSE;
+                }
             }
         } else if (g_str_has_prefix(argv[i], "-g")) {
+            const char **target = scope ? &scope_gamma_str[scope - args->scopes] : &gamma_str;
             if (g_strcmp0(argv[i], "-g") == 0 && (i + 1) < argc) {
-                gamma_str = argv[++i];
+                *target = argv[++i];
             } else if (g_str_has_prefix(argv[i], "-g=")) {
-                gamma_str = argv[i] + 3; // Skip "-g="
+                *target = argv[i] + 3; // Skip "-g="
             }
         } else if (g_str_has_prefix(argv[i], "-t")) {
             const char* temp_val_str = NULL;
@@ -136,299 +811,4439 @@ static void parse_arguments(int argc, char *argv[], AppArgs *args) {
                 temp_val_str = argv[i] + 3; // Skip "-t="
             }
             if (temp_val_str) {
-                 args->temperature = atoi(temp_val_str);
+                 gint temperature = atoi(temp_val_str);
+                 gboolean relative = is_relative(temp_val_str);
+                 if (scope) {
+                     scope->temperature = temperature;
+                     scope->temperature_relative = relative;
+                     scope_has_temperature[scope - args->scopes] = TRUE;
+                 } else {
+                     args->temperature = temperature;
+                     args->temperature_relative = relative;
+                 }
+                 const char *range_end = strstr(temp_val_str, "..");
+                 if (range_end) {
+                     args->temperature_end = atoi(range_end + 2); // Skip ".."
+                     if (temperature <= 0 || args->temperature_end <= 0) {
+                         g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                                     "A transition needs two temperatures, e.g. -t 6500..3400.");
+                         return FALSE;
+                     }
+                 }
+            }
+        } else if (g_str_has_prefix(argv[i], "-n")) {
+            const char* samples_str = NULL;
+            if (g_strcmp0(argv[i], "-n") == 0 && (i + 1) < argc) {
+                samples_str = argv[++i];
+            } else if (g_str_has_prefix(argv[i], "-n=")) {
+                samples_str = argv[i] + 3; // Skip "-n="
+            }
+            if (g_strcmp0(samples_str, "auto") == 0) {
+                args->auto_samples = TRUE;
+            } else if (samples_str) {
+                gint samples = atoi(samples_str);
+                if (samples < 2 || samples > MAX_SAMPLES) {
+                    g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                                "LUT size must be between 2 and %d, or 'auto'.", MAX_SAMPLES);
+                    return FALSE;
+                }
+                args->n_samples = samples;
             }
         }
     }
 
-    gchar **parts = g_strsplit(gamma_str, ":", 3);
-    if (parts[0] && !parts[1]) {
-        gfloat val = g_ascii_strtod(parts[0], NULL);
-        args->gamma[0] = val; args->gamma[1] = val; args->gamma[2] = val;
-    } else if (parts[0] && parts[1] && parts[2]) {
-        args->gamma[0] = g_ascii_strtod(parts[0], NULL);
-        args->gamma[1] = g_ascii_strtod(parts[1], NULL);
-        args->gamma[2] = g_ascii_strtod(parts[2], NULL);
+    parse_gamma(gamma_str, args->gamma);
+    if (!gamma_is_relative(gamma_str, &args->gamma_relative, error)) {
+        return FALSE;
+    }
+    for (guint i = 0; i < args->n_scopes; i++) {
+        DeviceSettings *settings = &args->scopes[i];
+        if (scope_gamma_str[i]) {
+            parse_gamma(scope_gamma_str[i], settings->gamma);
+            if (!gamma_is_relative(scope_gamma_str[i], &settings->gamma_relative, error)) {
+                return FALSE;
+            }
+        } else {
+            memcpy(settings->gamma, args->gamma, sizeof(settings->gamma));
+            settings->gamma_relative = args->gamma_relative;
+        }
+        if (!scope_has_temperature[i]) {
+            settings->temperature = args->temperature;
+            settings->temperature_relative = args->temperature_relative;
+        }
+    }
+    if (args->n_scopes == 1) {
+        // A single display: the same as before per-display settings existed.
+        const DeviceSettings *settings = &args->scopes[0];
+        args->device_index = settings->device_index;
+        memcpy(args->device_name, settings->device_name, sizeof(args->device_name));
+        memcpy(args->gamma, settings->gamma, sizeof(args->gamma));
+        args->temperature = settings->temperature;
+        args->gamma_relative = settings->gamma_relative;
+        args->temperature_relative = settings->temperature_relative;
     }
-    g_strfreev(parts);
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s [-d INDEX] [-g R:G:B|G] [-t TEMP] [-r] [-i]\n", argv[0]);
-        fprintf(stderr, "  -d INDEX       Target a specific display index (e.g., 0).\n");
-        fprintf(stderr, "  -g GAMMA       Target gamma (e.g., 0.8), 1.0 is neutral.\n");
-        fprintf(stderr, "  -t TEMPERATURE Target color temperature, 6500 is neutral.\n");
-        fprintf(stderr, "  -r             Remove existing profile created by this tool.\n");
-        fprintf(stderr, "  -i             Display info about the current profile.\n");
-        exit(1);
+    if (args_is_relative(args) && (args->temperature_end > 0 || args->daemon_mode ||
+                                   args->generate_base || args->generate_batch ||
+                                   args->info_mode || args->remove_profile || args->gc_mode)) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                    "Relative -g or -t can't be combined with a transition, --daemon, --generate, -i, -r or --gc.");
+        return FALSE;
+    }
+    if (args->temperature_end > 0) {
+        if (args->over_seconds == 0) {
+            g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "-t START..END needs --over DURATION.");
+            return FALSE;
+        }
+        if (args->remove_profile || args->info_mode || args->gc_mode || args->direct ||
+            args->generate_base || args->generate_batch || args->n_scopes > 1) {
+            g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                        "A transition can't be combined with -r, -i, --gc, --direct, --generate or several -d.");
+            return FALSE;
+        }
+    } else if (args->over_seconds || args->checkpoint_seconds) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                    "--over and --checkpoint need a temperature range, e.g. -t 6500..3400.");
+        return FALSE;
+    }
+    if (args->json && !args->info_mode) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--json needs -i.");
+        return FALSE;
+    }
+    if ((args->schedule || args->location) && !args->daemon_mode) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--schedule and --location need --daemon.");
+        return FALSE;
     }
+
+    return argc >= 2;
 }
 
 /**
- * @brief Contains the core logic for processing a single device.
- *
- * This function encapsulates the logic that was previously in the main loop.
- * It fetches the current profile for the given device and then delegates to the
- * appropriate handler based on the program's operating mode.
- *
- * @param client (Input) The connected CdClient instance.
- * @param device (Input) The specific display device to process.
- * @param args   (Input) Pointer to the parsed application arguments.
+ * @brief Appends formatted text to a job's buffered output.
  */
-static void process_device(CdClient *client, CdDevice *device, AppArgs *args) {
-    printf("\ndevice: %s\n", cd_device_get_id(device));
-    GError *error = NULL;
+static void job_printf(DeviceJob *job, const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    g_string_append_vprintf(job->output, format, ap);
+    va_end(ap);
+}
 
-    GPtrArray *profiles = cd_device_get_profiles(device);
-    CdProfile *base_profile = NULL;
+/**
+ * @brief Reports a failure of the job's device on the run's stderr and fails the run.
+ *
+ * Unlike g_warning(), which only reaches the daemon's own stderr, this is
+ * passed on to the client of a forwarded or library request.
+ */
+static void job_error(DeviceJob *job, const char *format, ...) {
+    const char *device = cd_device_get_metadata_item(job->device, CD_DEVICE_METADATA_XRANDR_NAME);
+    va_list ap;
+    g_string_append_printf(job->run->errors, "Error: %s: ", device ? device : cd_device_get_id(job->device));
+    va_start(ap, format);
+    g_string_append_vprintf(job->run->errors, format, ap);
+    va_end(ap);
+    g_string_append_c(job->run->errors, '\n');
+    job->run->status = 1;
+}
 
-    if (profiles != NULL && profiles->len > 0) {
-        base_profile = g_object_ref(g_ptr_array_index(profiles, 0));
-    } else {
-        printf("No default profile, using sRGB\n");
-        base_profile = create_and_set_sRGB_profile(client, device);
-        if (!base_profile) {
-            g_warning("Could not set sRGB profile for %s. Skipping.", cd_device_get_id(device));
-            if (profiles) g_ptr_array_free(profiles, TRUE);
-            return;
+/**
+ * @brief Appends a string to a JSON document as a quoted, escaped literal.
+ */
+static void json_append_string(GString *json, const char *value) {
+    g_string_append_c(json, '"');
+    for (const char *p = value; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            g_string_append_c(json, '\\');
+            g_string_append_c(json, *p);
+        } else if ((guchar)*p < 0x20) {
+            g_string_append_printf(json, "\\u%04x", (guchar)*p);
+        } else {
+            g_string_append_c(json, *p);
         }
     }
-    if (profiles) g_ptr_array_free(profiles, TRUE);
-
-    if (!cd_profile_connect_sync(base_profile, NULL, &error)) {
-        g_warning("Could not connect to base profile: %s", error->message);
-        g_error_free(error); error = NULL;
-        g_object_unref(base_profile);
-        return;
-    }
-
-    if (args->info_mode) {
-        handle_info_mode(device, base_profile);
-    } else if (args->remove_profile) {
-        handle_remove_mode(device, base_profile);
-    } else {
-        handle_apply_mode(client, device, base_profile, args);
-    }
+    g_string_append_c(json, '"');
+}
 
-    g_object_unref(base_profile);
+/**
+ * @brief Appends a number to a JSON document, always with a '.' whatever the locale.
+ */
+static void json_append_number(GString *json, gdouble value) {
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+    g_string_append(json, g_ascii_formatd(buf, sizeof(buf), "%g", value));
 }
 
 /**
- * @brief Gets a list of all connected display devices from the colord service.
- * @return A GList of connected CdDevice objects. The caller must free this list.
+ * @brief Records how long a phase took, if --timings was given.
+ * @param device The device's connector or ID, or NULL for run-wide phases.
  */
-static GList *get_display_devices(CdClient *client) {
-    GError *error = NULL;
-    GPtrArray *all_devices = cd_client_get_devices_sync(client, NULL, &error);
-    if (error) {
-        g_critical("Failed to get devices: %s", error->message);
-        g_error_free(error);
-        return NULL;
-    }
-    GList *display_devices = NULL;
-    for (guint i = 0; i < all_devices->len; i++) {
-        CdDevice *device = g_ptr_array_index(all_devices, i);
-        if (!cd_device_connect_sync(device, NULL, &error)) {
-            g_warning("Could not connect to device %s: %s", cd_device_get_id(device), error->message);
-            g_error_free(error); error = NULL;
-            continue;
-        }
-        if (cd_device_get_kind(device) == CD_DEVICE_KIND_DISPLAY) {
-            display_devices = g_list_append(display_devices, g_object_ref(device));
+static void run_add_timing(RunContext *run, const char *device, const char *phase, gint64 usec) {
+    if (run->args.timings == TIMINGS_JSON) {
+        g_string_append(run->timings, "{\"device\":");
+        if (device) {
+            json_append_string(run->timings, device);
+        } else {
+            g_string_append(run->timings, "null");
         }
+        g_string_append(run->timings, ",\"phase\":");
+        json_append_string(run->timings, phase);
+        g_string_append_printf(run->timings, ",\"us\":%" G_GINT64_FORMAT "}\n", usec);
+    } else if (run->args.timings == TIMINGS_TEXT) {
+        g_string_append_printf(run->timings, "timing: %-24s %-16s %9.3f ms\n",
+                               device ? device : "-", phase, usec / 1000.0);
     }
-    g_ptr_array_free(all_devices, TRUE);
-    return display_devices;
 }
 
 /**
- * @brief Handles the -i (info) mode for a single device.
+ * @brief Ends the job's current phase, recording the time spent since the previous one.
+ *
+ * Phases are sequential within a job, so each one runs from the end of the
+ * previous phase (or the start of the job) to this call.
  */
-static void handle_info_mode(CdDevice *device, CdProfile *profile) {
-    const char *profile_filename = cd_profile_get_filename(profile);
-    if (profile_filename == NULL) {
-        printf("Current profile has no filename.\n");
+static void job_phase(DeviceJob *job, const char *phase) {
+    if (job->run->args.timings == TIMINGS_NONE) {
         return;
     }
-    gchar *basename = g_path_get_basename(profile_filename);
-    if (g_str_has_prefix(basename, OUR_PREFIX)) {
-        int r, g, b, temp;
-        int items = sscanf(basename, "gamma-tool-g%3d%3d%3dt%d-", &r, &g, &b, &temp);
-        if (items == 4) {
-            printf("gamma: %.2f:%.2f:%.2f\n", r / 100.0f, g / 100.0f, b / 100.0f);
-            printf("temperature: %d\n", temp);
-        } else {
-            printf("Could not parse parameters from profile name: %s\n", basename);
-        }
-    } else {
-        printf("Current profile is not a gamma-tool profile: %s\n", profile_filename);
-    }
-    g_free(basename);
+    gint64 now = g_get_monotonic_time();
+    const char *device = cd_device_get_metadata_item(job->device, CD_DEVICE_METADATA_XRANDR_NAME);
+    run_add_timing(job->run, device ? device : cd_device_get_id(job->device), phase, now - job->phase_start);
+    job->phase_start = now;
 }
 
 /**
- * @brief Handles the -r (remove) mode for a single device.
+ * @brief Drops one reference on the run's pending count and reports completion at zero.
  */
-static void handle_remove_mode(CdDevice *device, CdProfile *profile) {
-    const char *profile_filename = cd_profile_get_filename(profile);
-    printf("Current profile is %s\n", profile_filename ? profile_filename : cd_profile_get_id(profile));
-
-    gboolean is_our_profile = FALSE;
-    if (profile_filename != NULL) {
-        gchar *basename = g_path_get_basename(profile_filename);
-        if (g_str_has_prefix(basename, OUR_PREFIX)) {
-            is_our_profile = TRUE;
+static void run_release(RunContext *run) {
+    if (--run->pending == 0) {
+        if (!run->args.info_mode && !run->args.remove_profile) {
+            profile_cache_prune(run->session);
         }
-        g_free(basename);
-    }
-    if (is_our_profile) {
-        GError *error = NULL;
-        printf("Removing profile from device...\n");
-        if (cd_device_remove_profile_sync(device, profile, NULL, &error)) {
-            printf("Deleting file %s\n", profile_filename);
-            if (remove(profile_filename) != 0) {
-                g_warning("Could not delete profile file: %s", profile_filename);
+        if (run->discovery_learned) {
+            discovery_latency_save(run->session);
+        }
+        if (args_is_apply(&run->args)) {
+            stats_observe(&run->session->stats.apply_seconds, g_get_monotonic_time() - run->start_time);
+        }
+        if (run->args.timings != TIMINGS_NONE) {
+            if (run->discovery_deadline) {
+                run_add_timing(run, NULL, "discovery-wait", run->discovery_usec);
             }
-        } else {
-            g_warning("Could not remove profile from device: %s", error->message);
-            g_error_free(error);
+            run_add_timing(run, NULL, "total", g_get_monotonic_time() - run->start_time);
+            g_string_append(run->errors, run->timings->str);
         }
-    } else {
-        printf("Current profile was not created by this tool. Not removing.\n");
+        run->done(run, run->done_data);
     }
 }
 
+static void run_end_prepare(RunContext *run);
+
 /**
- * @brief Handles the default mode: creating and applying a new profile.
+ * @brief Takes a job out of the prepare phase.
+ * @param failed TRUE if the job gave up before its profile was ready, which
+ *               rolls back every other display of the run.
  */
-static void handle_apply_mode(CdClient *client, CdDevice *device, CdProfile *profile, AppArgs *args) {
-    const char *profile_filename = cd_profile_get_filename(profile);
-    printf("Current profile is %s\n", profile_filename ? profile_filename : cd_profile_get_id(profile));
-
-    gboolean is_our_profile = FALSE;
-    if (profile_filename != NULL) {
-        gchar *basename = g_path_get_basename(profile_filename);
-        if (g_str_has_prefix(basename, OUR_PREFIX)) {
-            is_our_profile = TRUE;
-        }
-        g_free(basename);
-    }
-    
-    GError *error = NULL;
-    CdIcc *profile_data = cd_profile_load_icc(profile, CD_ICC_LOAD_FLAGS_NONE, NULL, &error);
-    if (error) {
-        g_warning("Could not get ICC data from base profile: %s", error->message);
-        g_error_free(error);
+static void job_leave_transaction(DeviceJob *job, gboolean failed) {
+    if (!job->in_transaction) {
         return;
     }
-    
-    gchar *title = g_strdup_printf("gamma-tool: g=%.2f:%.2f:%.2f t=%d", args->gamma[0], args->gamma[1], args->gamma[2], args->temperature);
-    cd_icc_set_description(profile_data, "", title);
-    g_free(title);
-
-    gchar *uuid_str = g_uuid_string_random();
-    cd_icc_add_metadata(profile_data, "uuid", uuid_str);
-    generate_vcgt(args->gamma, args->temperature, profile_data);
-
-    int r = (int)(args->gamma[0] * 100.0f); int g = (int)(args->gamma[1] * 100.0f); int b = (int)(args->gamma[2] * 100.0f);
-    gchar *new_basename = g_strdup_printf("%sg%03d%03d%03dt%d-%s.icc",
-                                          OUR_PREFIX, r, g, b, args->temperature, uuid_str);
-    gchar *icc_dir = g_build_filename(g_get_user_data_dir(), "icc", NULL);
-    g_mkdir_with_parents(icc_dir, 0755);
-    gchar *new_path = g_build_filename(icc_dir, new_basename, NULL);
-    GFile *profile_file = g_file_new_for_path(new_path);
-    CdProfile *new_profile = NULL;
-    
-    if (!cd_icc_save_file(profile_data, profile_file, CD_ICC_SAVE_FLAGS_NONE, NULL, &error)) {
-        g_warning("Could not save new profile to %s: %s", new_path, error->message);
-        g_error_free(error);
-    } else {
-        gint64 deadline = g_get_monotonic_time() + TIMEOUT_SECONDS * G_TIME_SPAN_SECOND;
-        while (g_get_monotonic_time() < deadline) {
-            new_profile = cd_client_find_profile_by_filename_sync(client, new_path, NULL, NULL);
-            if (new_profile) break;
-            g_main_context_iteration(NULL, FALSE);
-            g_usleep(10000);
-        }
-        if (new_profile && cd_profile_connect_sync(new_profile, NULL, &error)) {
-            printf("New profile is %s\n", cd_profile_get_filename(new_profile));
-            if (!cd_device_add_profile_sync(device, CD_DEVICE_RELATION_HARD, new_profile, NULL, NULL))
-                g_warning("Failed to add new profile to device.");
-            if (!cd_device_make_profile_default_sync(device, new_profile, NULL, NULL))
-                g_warning("Failed to make new profile default.");
-        } else if (new_profile) {
-            g_warning("Could not connect to new profile: %s", error->message);
-            g_error_free(error);
-        } else {
-            g_warning("Timed out waiting for colord to detect new profile: %s", new_path);
-        }
+    job->in_transaction = FALSE;
+    if (failed) {
+        job->run->prepare_failed = TRUE;
+    }
+    if (--job->run->preparing == 0) {
+        run_end_prepare(job->run);
     }
+}
 
-    if (is_our_profile && new_profile) {
-        printf("Removing old profile...\n");
-        if (cd_device_remove_profile_sync(device, profile, NULL, &error)) {
-            printf("Deleting file %s\n", profile_filename);
-            if (remove(profile_filename) != 0) {
-                g_warning("Could not delete old profile file: %s", profile_filename);
-            }
-        } else {
-             g_warning("Could not remove old profile from device: %s", error->message);
-             g_error_free(error);
-        }
+/**
+ * @brief Marks a device pipeline as complete; the run finishes after the last one.
+ */
+static void job_finish(DeviceJob *job) {
+    // Ending without reaching the commit point (and without being a no-op) is a failure.
+    job_leave_transaction(job, !job->prepared);
+    if (job->run->args.timings != TIMINGS_NONE) {
+        job->phase_start = job->start_time;
+        job_phase(job, "total");
     }
+    run_release(job->run);
+}
 
-    if (new_profile) g_object_unref(new_profile);
-    g_object_unref(profile_file);
-    g_free(new_basename); g_free(icc_dir); g_free(new_path);
-    g_free(uuid_str); g_object_unref(profile_data);
+static void device_job_free(DeviceJob *job) {
+    g_object_unref(job->device);
+    if (job->profile) g_object_unref(job->profile);
+    if (job->new_profile) g_object_unref(job->new_profile);
+    g_free(job->new_path);
+    g_free(job->cache_key);
+    g_string_free(job->output, TRUE);
+    g_free(job);
 }
 
+// --- Stats ---
+
 /**
- * @brief Generates a Video Card Gamma Table (VCGT) and applies it to an ICC profile.
+ * @brief Counts one observation of usec microseconds in a histogram.
  */
-static void generate_vcgt(gfloat gamma[3], gint color_temperature, CdIcc *profile_data) {
-    gfloat gamma_factor[3];
-    gamma_factor[0] = 1.0f / gamma[0]; gamma_factor[1] = 1.0f / gamma[1]; gamma_factor[2] = 1.0f / gamma[2];
-    CdColorRGB temp_color; GError *error = NULL;
-    GPtrArray *vcgt_array = g_ptr_array_new_with_free_func(g_free);
-    cd_color_get_blackbody_rgb_full(color_temperature, &temp_color, CD_COLOR_BLACKBODY_FLAG_USE_PLANCKIAN);
-    for (gint i = 0; i < N_SAMPLES; i++) {
-        CdColorRGB *c = g_new(CdColorRGB, 1);
-        gdouble step = (gdouble)i / (N_SAMPLES - 1);
-        c->R = temp_color.R * pow(step, gamma_factor[0]);
-        c->G = temp_color.G * pow(step, gamma_factor[1]);
-        c->B = temp_color.B * pow(step, gamma_factor[2]);
-        c->R = CLAMP(c->R, 0.0, 1.0); c->G = CLAMP(c->G, 0.0, 1.0); c->B = CLAMP(c->B, 0.0, 1.0);
-        g_ptr_array_add(vcgt_array, c);
-    }
-    if (!cd_icc_set_vcgt(profile_data, vcgt_array, &error)) {
-        g_warning("Failed to set VCGT: %s", error->message);
-        g_error_free(error);
+static void stats_observe(StatsHistogram *histogram, gint64 usec) {
+    gdouble seconds = usec / (gdouble)G_USEC_PER_SEC;
+    for (guint i = 0; i < STATS_N_BUCKETS; i++) {
+        if (seconds <= stats_buckets[i]) {
+            histogram->counts[i]++;
+            break;
+        }
     }
-    g_ptr_array_free(vcgt_array, TRUE);
+    histogram->count++;
+    histogram->sum += seconds;
 }
 
 /**
- * @brief Finds the standard sRGB profile and sets it as the default for a device.
+ * @brief Adds one sample to the Prometheus text and/or the D-Bus dictionary.
+ * @param labels e.g. "{le=\"0.5\"}", or "" for none.
  */
-static CdProfile *create_and_set_sRGB_profile(CdClient *client, CdDevice *device) {
-    GError *error = NULL;
-    CdProfile *profile = cd_client_find_profile_by_filename_sync(client, "sRGB.icc", NULL, &error);
-    if (!profile) {
-        g_warning("Failed to find sRGB.icc profile: %s", error ? error->message : "Not found");
-        if(error) g_error_free(error);
+static void stats_add_sample(GString *text, GVariantBuilder *dict, const char *name, const char *labels, gdouble value) {
+    gchar *sample = g_strconcat(name, labels, NULL);
+    if (text) g_string_append_printf(text, "%s %.17g\n", sample, value);
+    if (dict) g_variant_builder_add(dict, "{sd}", sample, value);
+    g_free(sample);
+}
+
+static void stats_add_counter(GString *text, GVariantBuilder *dict, const char *name, const char *help, guint64 value) {
+    if (text) g_string_append_printf(text, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    stats_add_sample(text, dict, name, "", value);
+}
+
+/**
+ * @brief Adds a histogram as the usual cumulative _bucket series plus _sum and _count.
+ */
+static void stats_add_histogram(GString *text, GVariantBuilder *dict, const char *name, const char *help,
+                                const StatsHistogram *histogram) {
+    if (text) g_string_append_printf(text, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    gchar *bucket = g_strconcat(name, "_bucket", NULL);
+    guint64 cumulative = 0;
+    for (guint i = 0; i < STATS_N_BUCKETS; i++) {
+        cumulative += histogram->counts[i];
+        gchar *labels = g_strdup_printf("{le=\"%g\"}", stats_buckets[i]);
+        stats_add_sample(text, dict, bucket, labels, cumulative);
+        g_free(labels);
+    }
+    stats_add_sample(text, dict, bucket, "{le=\"+Inf\"}", histogram->count);
+    g_free(bucket);
+    gchar *sum = g_strconcat(name, "_sum", NULL);
+    gchar *count = g_strconcat(name, "_count", NULL);
+    stats_add_sample(text, dict, sum, "", histogram->sum);
+    stats_add_sample(text, dict, count, "", histogram->count);
+    g_free(count);
+    g_free(sum);
+}
+
+/**
+ * @brief Renders the counters as Prometheus text, a D-Bus dictionary, or both.
+ *
+ * The dictionary uses the same sample names as the text, labels included,
+ * so both can be read by the same dashboards.
+ * @param text Appended to if not NULL.
+ * @param dict Filled with "{sd}" entries if not NULL.
+ */
+static void stats_render(const Stats *stats, GString *text, GVariantBuilder *dict) {
+    stats_add_histogram(text, dict, "gamma_tool_apply_duration_seconds",
+                        "Time to apply settings to the selected displays.", &stats->apply_seconds);
+    stats_add_histogram(text, dict, "gamma_tool_discovery_wait_seconds",
+                        "Time waiting for colord to detect a new profile.", &stats->discovery_seconds);
+    stats_add_counter(text, dict, "gamma_tool_profile_cache_hits_total",
+                      "Generated profiles reused from disk.", stats->cache_hits);
+    stats_add_counter(text, dict, "gamma_tool_profile_cache_misses_total",
+                      "Generated profiles that had to be written.", stats->cache_misses);
+    stats_add_counter(text, dict, "gamma_tool_noop_skips_total",
+                      "Displays that already had the requested profile.", stats->noop_skips);
+    stats_add_counter(text, dict, "gamma_tool_gc_deleted_files_total",
+                      "Profile files deleted by cache eviction or --gc.", stats->gc_files);
+    stats_add_counter(text, dict, "gamma_tool_colord_errors_total",
+                      "Failed colord calls and discovery timeouts while applying or removing.", stats->colord_errors);
+}
+
+/**
+ * @brief Rewrites the --metrics textfile.
+ *
+ * g_file_set_contents() renames a complete temporary file into place, so
+ * node_exporter never reads a partial one.
+ */
+static void stats_write_textfile(const Stats *stats, const char *path) {
+    GString *text = g_string_new(NULL);
+    stats_render(stats, text, NULL);
+    GError *error = NULL;
+    if (!g_file_set_contents(path, text->str, text->len, &error)) {
+        g_warning("Could not write metrics to %s: %s", path, error->message);
+        g_error_free(error);
+    }
+    g_string_free(text, TRUE);
+}
+
+// --- Session: colord connection and caches ---
+
+static void on_devices_changed(CdClient *client, CdDevice *device, gpointer user_data) {
+    Session *session = user_data;
+    session->devices_valid = FALSE;
+}
+
+static void on_profile_removed(CdClient *client, CdProfile *profile, gpointer user_data) {
+    Session *session = user_data;
+    CdProfile *cached = g_hash_table_lookup(session->profiles, cd_profile_get_object_path(profile));
+    if (cached) {
+        const char *filename = cd_profile_get_filename(cached);
+        if (filename) g_hash_table_remove(session->base_icc, filename);
+        g_hash_table_remove(session->profiles, cd_profile_get_object_path(profile));
+    }
+}
+
+static void direct_settings_free(DirectSettings *settings) {
+    g_free(settings->profile_path);
+    g_free(settings);
+}
+
+/**
+ * @brief Returns the object path of the device's default profile, or NULL if it has none.
+ */
+static gchar *device_default_profile_path(CdDevice *device) {
+    GPtrArray *profiles = cd_device_get_profiles(device);
+    gchar *path = NULL;
+    if (profiles && profiles->len > 0) {
+        path = g_strdup(cd_profile_get_object_path(g_ptr_array_index(profiles, 0)));
+    }
+    if (profiles) g_ptr_array_free(profiles, TRUE);
+    return path;
+}
+
+/**
+ * @brief Remembers the settings of a --direct change, which the profile doesn't show.
+ */
+static void session_remember_direct(Session *session, CdDevice *device, const AppArgs *args) {
+    DirectSettings *settings = g_new0(DirectSettings, 1);
+    memcpy(settings->gamma, args->gamma, sizeof(settings->gamma));
+    settings->temperature = args->temperature;
+    settings->profile_path = device_default_profile_path(device);
+    g_hash_table_replace(session->direct_settings, g_strdup(cd_device_get_id(device)), settings);
+}
+
+/**
+ * @brief Connects to colord and sets up the device and profile caches.
+ * @return A new session, or NULL if colord is unreachable.
+ */
+static Session *session_new(GError **error) {
+    CdClient *client = cd_client_new();
+    if (!cd_client_connect_sync(client, NULL, error)) {
+        g_object_unref(client);
+        return NULL;
+    }
+    Session *session = g_new0(Session, 1);
+    session->client = client;
+    session->profiles = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
+    session->base_icc = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
+    session->templates = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)icc_template_free);
+    session->direct_settings = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)direct_settings_free);
+    g_signal_connect(client, "device-added", G_CALLBACK(on_devices_changed), session);
+    g_signal_connect(client, "device-removed", G_CALLBACK(on_devices_changed), session);
+    g_signal_connect(client, "profile-removed", G_CALLBACK(on_profile_removed), session);
+    return session;
+}
+
+static void session_free(Session *session) {
+    g_signal_handlers_disconnect_by_data(session->client, session);
+    g_list_free_full(session->devices, g_object_unref);
+    g_hash_table_unref(session->profiles);
+    g_hash_table_unref(session->base_icc);
+    g_hash_table_unref(session->templates);
+    g_hash_table_unref(session->direct_settings);
+    if (session->crtcs) g_hash_table_unref(session->crtcs);
+    if (session->bus) {
+        g_dbus_connection_signal_unsubscribe(session->bus, session->monitors_changed_id);
+        g_object_unref(session->bus);
+    }
+    g_object_unref(session->client);
+    g_free(session);
+}
+
+/**
+ * @brief Returns the display devices, enumerating them only if the cache is stale.
+ * @return The session's list; it stays owned by the session.
+ */
+static GList *session_get_devices(Session *session) {
+    if (!session->devices_valid) {
+        g_list_free_full(session->devices, g_object_unref);
+        session->devices = get_display_devices(session->client);
+        session->devices_valid = TRUE;
+    }
+    return session->devices;
+}
+
+/**
+ * @brief Remembers a connected profile so later runs can skip cd_profile_connect.
+ */
+static void session_cache_profile(Session *session, CdProfile *profile) {
+    g_hash_table_replace(session->profiles, g_strdup(cd_profile_get_object_path(profile)), g_object_ref(profile));
+}
+
+static gboolean is_gamma_tool_profile(CdProfile *profile);
+static gboolean is_slot_profile(CdProfile *profile);
+
+/**
+ * @brief Finds the file a profile's ICC data should be derived from, and its checksum.
+ *
+ * For our own profiles this is the original base recorded in GAMMA_TOOL_base,
+ * as long as that file still exists; otherwise it is the profile's own file.
+ * Both come from colord's cached metadata, so nothing is loaded. The checksum
+ * is NULL if colord doesn't know it.
+ */
+static void profile_get_base(CdProfile *profile, const char **filename, const char **checksum) {
+    const char *base = cd_profile_get_metadata_item(profile, "GAMMA_TOOL_base");
+    if (is_gamma_tool_profile(profile) && base != NULL && g_file_test(base, G_FILE_TEST_IS_REGULAR)) {
+        *filename = base;
+        *checksum = cd_profile_get_metadata_item(profile, "GAMMA_TOOL_base_checksum");
+        return;
+    }
+    *filename = cd_profile_get_filename(profile);
+    *checksum = cd_profile_get_metadata_item(profile, CD_PROFILE_METADATA_FILE_CHECKSUM);
+}
+
+/**
+ * @brief Returns the parsed ICC data for a base profile, loading it on first use.
+ *
+ * Generated profiles record the base they were derived from in their
+ * GAMMA_TOOL_base metadata, so re-applying on top of one of our own profiles
+ * starts again from the original base and hits the cache.
+ *
+ * @return A new reference to the cached CdIcc, or NULL with error set.
+ */
+static CdIcc *session_get_base_icc(Session *session, CdProfile *profile, GError **error) {
+    const char *base, *checksum;
+    profile_get_base(profile, &base, &checksum);
+    CdIcc *icc = base ? g_hash_table_lookup(session->base_icc, base) : NULL;
+    if (icc) {
+        return g_object_ref(icc);
+    }
+    if (base && g_strcmp0(base, cd_profile_get_filename(profile)) != 0) {
+        GFile *file = g_file_new_for_path(base);
+        icc = cd_icc_new();
+        gboolean ok = cd_icc_load_file(icc, file, CD_ICC_LOAD_FLAGS_NONE, NULL, error);
+        g_object_unref(file);
+        if (!ok) {
+            g_object_unref(icc);
+            return NULL;
+        }
+    } else {
+        icc = cd_profile_load_icc(profile, CD_ICC_LOAD_FLAGS_NONE, NULL, error);
+        if (!icc) {
+            return NULL;
+        }
+    }
+    if (base) {
+        g_hash_table_insert(session->base_icc, g_strdup(base), g_object_ref(icc));
+    }
+    return icc;
+}
+
+// --- Runs ---
+
+/**
+ * @brief Creates a run for one request; nothing happens until run_start().
+ */
+static RunContext *run_new(Session *session, const AppArgs *args, RunDoneFunc done, gpointer done_data) {
+    RunContext *run = g_new0(RunContext, 1);
+    run->session = session;
+    run->args = *args;
+    run->jobs = g_ptr_array_new_with_free_func((GDestroyNotify)device_job_free);
+    run->output = g_string_new(NULL);
+    run->errors = g_string_new(NULL);
+    run->start_time = g_get_monotonic_time();
+    run->timings = g_string_new(NULL);
+    run->done = done;
+    run->done_data = done_data;
+    return run;
+}
+
+/**
+ * @brief Starts one pipeline per -d display, each with its own settings.
+ *
+ * All displays are resolved first, so a display given twice only gets the
+ * last settings instead of two pipelines racing on it.
+ */
+static void run_start_scopes(RunContext *run) {
+    guint n_scopes = run->args.n_scopes;
+    CdDevice *devices[MAX_DEVICE_SCOPES] = { NULL };
+    for (guint i = 0; i < n_scopes; i++) {
+        const DeviceSettings *settings = &run->args.scopes[i];
+        if (settings->device_name[0] != '\0') {
+            GError *error = NULL;
+            devices[i] = session_find_device(run->session, settings->device_name, &error);
+            if (!devices[i]) {
+                g_string_append_printf(run->errors, "Error: %s\n", error->message);
+                g_error_free(error);
+                run->status = 1;
+            }
+            continue;
+        }
+        GList *display_devices = session_get_devices(run->session);
+        guint num_devices = g_list_length(display_devices);
+        if (settings->device_index >= (gint)num_devices) {
+            g_string_append_printf(run->errors, "Error: Invalid device index %d. Only %u devices found (0 to %u).\n",
+                                   settings->device_index, num_devices, num_devices > 0 ? num_devices - 1 : 0);
+            run->status = 1;
+        } else {
+            devices[i] = g_object_ref(g_list_nth_data(display_devices, settings->device_index));
+        }
+    }
+    for (guint i = 0; i < n_scopes; i++) {
+        gboolean given_again = FALSE;
+        for (guint j = i + 1; devices[i] && j < n_scopes; j++) {
+            given_again |= devices[j] && g_strcmp0(cd_device_get_object_path(devices[i]),
+                                                   cd_device_get_object_path(devices[j])) == 0;
+        }
+        if (devices[i] && !given_again) {
+            process_device(run, devices[i], &run->args.scopes[i]);
+        }
+    }
+    for (guint i = 0; i < n_scopes; i++) {
+        if (devices[i]) g_object_unref(devices[i]);
+    }
+}
+
+/**
+ * @brief Starts every device pipeline of a run.
+ *
+ * `done` is called once all of them have finished, which may happen before
+ * this function returns if there was nothing to wait for.
+ */
+static void run_start(RunContext *run) {
+    // Hold a reference while starting so a job that finishes synchronously
+    // can't complete the run before the remaining devices are started.
+    run->pending = 1;
+    gint64 phase_start = g_get_monotonic_time();
+    if (run->args.auto_samples || run->args.direct || run->args.temperature_end > 0) {
+        run->crtcs = session_get_crtcs(run->session);
+        run_add_timing(run, NULL, "gamma-sizes", g_get_monotonic_time() - phase_start);
+        phase_start = g_get_monotonic_time();
+    }
+
+    if (run->args.gc_mode) {
+        run_gc(run);
+        run_add_timing(run, NULL, "gc", g_get_monotonic_time() - phase_start);
+        run_release(run);
+        return;
+    }
+
+    if (run->devices) {
+        for (guint i = 0; i < run->devices->len; i++) {
+            process_device(run, g_ptr_array_index(run->devices, i), NULL);
+        }
+        run_release(run);
+        return;
+    }
+
+    if (run->args.n_scopes > 1) {
+        run_start_scopes(run);
+        run_add_timing(run, NULL, "devices", g_get_monotonic_time() - phase_start);
+        run_release(run);
+        return;
+    }
+
+    if (run->args.device_name[0] != '\0') {
+        // Named device: look it up directly instead of enumerating everything.
+        GError *error = NULL;
+        CdDevice *device = session_find_device(run->session, run->args.device_name, &error);
+        run_add_timing(run, NULL, "devices", g_get_monotonic_time() - phase_start);
+        if (device) {
+            process_device(run, device, NULL);
+            g_object_unref(device);
+        } else {
+            g_string_append_printf(run->errors, "Error: %s\n", error->message);
+            g_error_free(error);
+            run->status = 1;
+        }
+        run_release(run);
+        return;
+    }
+
+    // --- Discover Devices ---
+    GList *display_devices = session_get_devices(run->session);
+    run_add_timing(run, NULL, "devices", g_get_monotonic_time() - phase_start);
+    if (!display_devices) {
+        g_string_append(run->output, "No display devices found.\n");
+    } else if (run->args.device_index != -1) {
+        // Single device mode
+        guint num_devices = g_list_length(display_devices);
+        if (run->args.device_index >= (gint)num_devices) {
+            g_string_append_printf(run->errors, "Error: Invalid device index %d. Only %u devices found (0 to %u).\n",
+                                   run->args.device_index, num_devices, num_devices > 0 ? num_devices - 1 : 0);
+            run->status = 1;
+        } else {
+            process_device(run, g_list_nth_data(display_devices, run->args.device_index), NULL);
+        }
+    } else {
+        // All devices mode
+        for (GList *l = display_devices; l != NULL; l = l->next) {
+            process_device(run, l->data, NULL);
+        }
+    }
+    run_release(run);
+}
+
+/**
+ * @brief Returns the per-device output of a finished run, in device order.
+ */
+static gchar *run_get_output(RunContext *run) {
+    if (run->args.info_mode && run->args.json) {
+        // Each job holds one JSON object, or nothing if it failed; errors
+        // still go to run->errors.
+        GString *json = g_string_new("{\"devices\":[");
+        gboolean first = TRUE;
+        for (guint i = 0; i < run->jobs->len; i++) {
+            DeviceJob *job = g_ptr_array_index(run->jobs, i);
+            if (job->output->len == 0) continue;
+            if (!first) g_string_append_c(json, ',');
+            g_string_append(json, job->output->str);
+            first = FALSE;
+        }
+        g_string_append(json, "]}\n");
+        return g_string_free(json, FALSE);
+    }
+    GString *output = g_string_new(run->output->str);
+    for (guint i = 0; i < run->jobs->len; i++) {
+        DeviceJob *job = g_ptr_array_index(run->jobs, i);
+        g_string_append(output, job->output->str);
+    }
+    return g_string_free(output, FALSE);
+}
+
+static void run_free(RunContext *run) {
+    if (run->prepared) g_ptr_array_unref(run->prepared);
+    if (run->crtcs) g_hash_table_unref(run->crtcs);
+    if (run->shared_profiles) g_hash_table_unref(run->shared_profiles);
+    if (run->devices) g_ptr_array_unref(run->devices);
+    g_ptr_array_free(run->jobs, TRUE);
+    g_string_free(run->output, TRUE);
+    g_string_free(run->errors, TRUE);
+    g_string_free(run->timings, TRUE);
+    g_free(run);
+}
+
+/**
+ * @brief Frees a run from an idle callback; `done` handlers run inside the run's own call stack.
+ */
+static gboolean run_free_idle(gpointer user_data) {
+    run_free(user_data);
+    return G_SOURCE_REMOVE;
+}
+
+static void on_base_profile_connected(GObject *source, GAsyncResult *res, gpointer user_data) {
+    DeviceJob *job = user_data;
+    GError *error = NULL;
+    if (!cd_profile_connect_finish(CD_PROFILE(source), res, &error)) {
+        job_error(job, "Could not connect to base profile: %s", error->message);
+        g_error_free(error);
+        job->run->session->stats.colord_errors++;
+        job_finish(job);
+        return;
+    }
+    session_cache_profile(job->run->session, job->profile);
+    job_phase(job, "profile-connect");
+    dispatch_mode(job);
+}
+
+/**
+ * @brief Turns the job's relative -g/-t deltas into absolute settings.
+ *
+ * The starting point is what a --direct request left on the display, as long
+ * as its default profile hasn't changed since; otherwise the settings embedded
+ * in the active gamma-tool profile, or neutral for any other profile.
+ * @param profile The device's connected default profile, or NULL if it
+ *                hasn't been fetched.
+ * @return FALSE if the profile is needed, i.e. it is NULL but the device has one.
+ */
+static gboolean job_resolve_relative(DeviceJob *job, CdProfile *profile) {
+    AppArgs *args = &job->args;
+    gfloat current_gamma[3] = {1.0f, 1.0f, 1.0f};
+    gint current_temperature = 6500;
+    guint current_samples;
+    gchar *default_path = device_default_profile_path(job->device);
+    DirectSettings *direct = g_hash_table_lookup(job->run->session->direct_settings, cd_device_get_id(job->device));
+    if (direct && g_strcmp0(direct->profile_path, default_path) == 0) {
+        memcpy(current_gamma, direct->gamma, sizeof(current_gamma));
+        current_temperature = direct->temperature;
+    } else if (profile) {
+        if (is_gamma_tool_profile(profile) &&
+            !profile_get_settings(profile, current_gamma, &current_temperature, &current_samples)) {
+            // Defaults again; profile_get_settings() may have written part of them.
+            current_gamma[0] = current_gamma[1] = current_gamma[2] = 1.0f;
+            current_temperature = 6500;
+        }
+    } else if (default_path) {
+        g_free(default_path);
+        return FALSE;
+    }
+    g_free(default_path);
+
+    if (args->gamma_relative) {
+        for (int i = 0; i < 3; i++) {
+            // Round to the two decimals of the profile name, so repeated steps don't drift.
+            gfloat value = roundf((current_gamma[i] + args->gamma[i]) * 100.0f) / 100.0f;
+            args->gamma[i] = MAX(value, RELATIVE_GAMMA_MIN);
+        }
+    }
+    if (args->temperature_relative) {
+        args->temperature = CLAMP(current_temperature + args->temperature, BLACKBODY_MIN, BLACKBODY_MAX);
+    }
+    args->gamma_relative = args->temperature_relative = FALSE;
+    job_printf(job, "Adjusting to gamma %.3g:%.3g:%.3g, temperature %d\n",
+               args->gamma[0], args->gamma[1], args->gamma[2], args->temperature);
+    return TRUE;
+}
+
+/**
+ * @brief Starts the async pipeline for a single device.
+ *
+ * This function encapsulates the logic that was previously in the main loop.
+ * It fetches the current profile for the given device and, once it is connected,
+ * delegates to the appropriate handler based on the program's operating mode.
+ * The job reports completion through job_finish().
+ *
+ * @param run      (Input) The run this device belongs to.
+ * @param device   (Input) The specific display device to process.
+ * @param settings (Input) This device's -g and -t, or NULL for the run's.
+ */
+static void process_device(RunContext *run, CdDevice *device, const DeviceSettings *settings) {
+    DeviceJob *job = g_new0(DeviceJob, 1);
+    job->run = run;
+    job->args = run->args;
+    if (settings) {
+        memcpy(job->args.gamma, settings->gamma, sizeof(job->args.gamma));
+        job->args.temperature = settings->temperature;
+        job->args.gamma_relative = settings->gamma_relative;
+        job->args.temperature_relative = settings->temperature_relative;
+    }
+    job->device = g_object_ref(device);
+    job->output = g_string_new(NULL);
+    job->start_time = job->phase_start = g_get_monotonic_time();
+    g_ptr_array_add(run->jobs, job);
+    run->pending++;
+    if (args_is_apply(&job->args)) {
+        // Every apply job is counted before any can finish, so the commit
+        // can't start until the whole run has been prepared.
+        job->in_transaction = TRUE;
+        run->preparing++;
+    }
+
+    if (!run->args.json) {
+        job_printf(job, "\ndevice: %s\n", cd_device_get_id(device));
+    }
+    gboolean relative = job->args.gamma_relative || job->args.temperature_relative;
+    if (relative && job_resolve_relative(job, NULL)) {
+        relative = FALSE;
+    }
+    if (run->args.direct && !relative) {
+        // The CRTC path needs no profile at all, unless a delta has to be read from it.
+        handle_direct_mode(job);
+        return;
+    }
+
+    GPtrArray *profiles = cd_device_get_profiles(device);
+    if (profiles != NULL && profiles->len > 0) {
+        CdProfile *current = g_ptr_array_index(profiles, 0);
+        CdProfile *cached = g_hash_table_lookup(run->session->profiles, cd_profile_get_object_path(current));
+        if (cached) {
+            job->profile = g_object_ref(cached);
+            dispatch_mode(job);
+        } else {
+            job->profile = g_object_ref(current);
+            cd_profile_connect(job->profile, NULL, on_base_profile_connected, job);
+        }
+    } else if (run->args.json) {
+        handle_info_mode(job); // Reports the missing profile without changing anything
+    } else {
+        job_printf(job, "No default profile, using sRGB\n");
+        create_and_set_sRGB_profile(job);
+    }
+    if (profiles) g_ptr_array_free(profiles, TRUE);
+}
+
+/**
+ * @brief Hands a job with a connected base profile to the handler for the current mode.
+ */
+static void dispatch_mode(DeviceJob *job) {
+    AppArgs *args = &job->args;
+    if (args->gamma_relative || args->temperature_relative) {
+        job_resolve_relative(job, job->profile);
+    }
+    if (args->info_mode) {
+        handle_info_mode(job);
+    } else if (args->remove_profile) {
+        handle_remove_mode(job);
+    } else if (args->direct) {
+        handle_direct_mode(job);
+    } else {
+        handle_apply_mode(job);
+    }
+}
+
+/**
+ * @brief Gets a list of all connected display devices from the colord service.
+ *
+ * colord filters by kind, so printers, scanners and cameras are never connected.
+ * @return A GList of connected CdDevice objects. The caller must free this list.
+ */
+static GList *get_display_devices(CdClient *client) {
+    GError *error = NULL;
+    GPtrArray *all_devices = cd_client_get_devices_by_kind_sync(client, CD_DEVICE_KIND_DISPLAY, NULL, &error);
+    if (error) {
+        g_critical("Failed to get devices: %s", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+    GList *display_devices = NULL;
+    for (guint i = 0; i < all_devices->len; i++) {
+        CdDevice *device = g_ptr_array_index(all_devices, i);
+        if (!cd_device_connect_sync(device, NULL, &error)) {
+            g_warning("Could not connect to device %s: %s", cd_device_get_id(device), error->message);
+            g_error_free(error); error = NULL;
+            continue;
+        }
+        display_devices = g_list_append(display_devices, g_object_ref(device));
+    }
+    g_ptr_array_free(all_devices, TRUE);
+    return display_devices;
+}
+
+/**
+ * @brief Finds a display by colord device ID or by connector name.
+ *
+ * Uses the session's device list if it is already loaded; otherwise asks
+ * colord for just that device, so no other device is connected.
+ * @return A new reference to the connected device, or NULL with error set.
+ */
+static CdDevice *session_find_device(Session *session, const char *name, GError **error) {
+    if (session->devices_valid) {
+        for (GList *l = session->devices; l != NULL; l = l->next) {
+            if (g_strcmp0(cd_device_get_id(l->data), name) == 0 ||
+                g_strcmp0(cd_device_get_metadata_item(l->data, CD_DEVICE_METADATA_XRANDR_NAME), name) == 0) {
+                return g_object_ref(l->data);
+            }
+        }
+    }
+
+    CdDevice *device = cd_client_find_device_sync(session->client, name, NULL, NULL);
+    if (!device) {
+        device = cd_client_find_device_by_property_sync(session->client, CD_DEVICE_METADATA_XRANDR_NAME, name, NULL, NULL);
+    }
+    if (!device) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No display device with ID or connector '%s'.", name);
+        return NULL;
+    }
+    if (!cd_device_connect_sync(device, NULL, error)) {
+        g_object_unref(device);
+        return NULL;
+    }
+    if (cd_device_get_kind(device) != CD_DEVICE_KIND_DISPLAY) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Device '%s' is not a display.", name);
+        g_object_unref(device);
+        return NULL;
+    }
+    return device;
+}
+
+/**
+ * @brief Returns TRUE if the profile's file was created by this tool.
+ */
+static gboolean is_gamma_tool_profile(CdProfile *profile) {
+    const char *profile_filename = cd_profile_get_filename(profile);
+    if (profile_filename == NULL) {
+        return FALSE;
+    }
+    gchar *basename = g_path_get_basename(profile_filename);
+    gboolean is_ours = g_str_has_prefix(basename, OUR_PREFIX);
+    g_free(basename);
+    return is_ours;
+}
+
+/**
+ * @brief Returns TRUE if a profile is one of the --slots profiles.
+ */
+static gboolean is_slot_profile(CdProfile *profile) {
+    const char *profile_filename = cd_profile_get_filename(profile);
+    if (profile_filename == NULL) {
+        return FALSE;
+    }
+    gchar *basename = g_path_get_basename(profile_filename);
+    gboolean is_slot = g_str_has_prefix(basename, SLOT_PREFIX);
+    g_free(basename);
+    return is_slot;
+}
+
+/**
+ * @brief Returns the path of the other profile slot of the same device.
+ */
+static gchar *slot_sibling_path(const char *slot_path) {
+    gchar *sibling = g_strdup(slot_path);
+    gsize len = strlen(sibling);
+    // Slot files end in "-a.icc" or "-b.icc".
+    if (len > 5) {
+        sibling[len - 5] = sibling[len - 5] == 'a' ? 'b' : 'a';
+    }
+    return sibling;
+}
+
+static gboolean parse_settings_metadata(const char *gamma_str, const char *temp_str, const char *samples_str,
+                                        gfloat gamma[3], gint *temperature, guint *n_samples);
+
+/**
+ * @brief Reads the exact settings embedded in a gamma-tool profile's metadata.
+ *
+ * Unlike the filename, which only keeps two decimals, the metadata round-trips
+ * the requested values exactly.
+ * @return FALSE if the profile carries no (or malformed) settings metadata.
+ */
+static gboolean profile_get_settings(CdProfile *profile, gfloat gamma[3], gint *temperature, guint *n_samples) {
+    const char *gamma_str, *temp_str, *samples_str;
+    CdIcc *icc = NULL;
+    if (is_slot_profile(profile)) {
+        // Slots are rewritten in place, so colord's copy of the metadata is stale.
+        GFile *file = g_file_new_for_path(cd_profile_get_filename(profile));
+        icc = cd_icc_new();
+        if (!cd_icc_load_file(icc, file, CD_ICC_LOAD_FLAGS_METADATA, NULL, NULL)) {
+            g_clear_object(&icc);
+        }
+        g_object_unref(file);
+        if (icc == NULL) {
+            return FALSE;
+        }
+        gamma_str = cd_icc_get_metadata_item(icc, "GAMMA_TOOL_gamma");
+        temp_str = cd_icc_get_metadata_item(icc, "GAMMA_TOOL_temperature");
+        samples_str = cd_icc_get_metadata_item(icc, "GAMMA_TOOL_samples");
+    } else {
+        gamma_str = cd_profile_get_metadata_item(profile, "GAMMA_TOOL_gamma");
+        temp_str = cd_profile_get_metadata_item(profile, "GAMMA_TOOL_temperature");
+        samples_str = cd_profile_get_metadata_item(profile, "GAMMA_TOOL_samples");
+    }
+    gboolean ok = parse_settings_metadata(gamma_str, temp_str, samples_str, gamma, temperature, n_samples);
+    if (icc) g_object_unref(icc);
+    return ok;
+}
+
+/**
+ * @brief Parses the GAMMA_TOOL_gamma, _temperature and _samples metadata values.
+ * @return FALSE if any is missing or malformed.
+ */
+static gboolean parse_settings_metadata(const char *gamma_str, const char *temp_str, const char *samples_str,
+                                        gfloat gamma[3], gint *temperature, guint *n_samples) {
+    if (gamma_str == NULL || temp_str == NULL || samples_str == NULL) {
+        return FALSE;
+    }
+    gchar **parts = g_strsplit(gamma_str, ":", -1);
+    gboolean ok = g_strv_length(parts) == 3;
+    for (int i = 0; ok && i < 3; i++) {
+        gchar *end;
+        g_strstrip(parts[i]); // Tolerates spaces in hand-edited metadata
+        gamma[i] = (gfloat)g_ascii_strtod(parts[i], &end);
+        ok = end != parts[i] && *end == '\0';
+    }
+    g_strfreev(parts);
+    *temperature = atoi(temp_str);
+    *n_samples = (guint)atoi(samples_str);
+    return ok;
+}
+
+/**
+ * @brief -i --json: appends the device as a JSON object, using only colord's properties.
+ *
+ * Nothing is loaded from disk, so in a daemon, where devices and profiles are
+ * already connected, this costs no D-Bus round trip at all. The settings come
+ * from the metadata colord read when the profile was added; --slots profiles
+ * are rewritten in place after that, so their settings are reported as null.
+ */
+static void handle_info_json(DeviceJob *job) {
+    GString *json = job->output;
+    const char *connector = cd_device_get_metadata_item(job->device, CD_DEVICE_METADATA_XRANDR_NAME);
+    const char *filename = job->profile ? cd_profile_get_filename(job->profile) : NULL;
+    gfloat gamma[3];
+    gint temperature;
+    guint n_samples;
+    gboolean ours = job->profile && is_gamma_tool_profile(job->profile);
+
+    g_string_append(json, "{\"id\":");
+    json_append_string(json, cd_device_get_id(job->device));
+    g_string_append(json, ",\"connector\":");
+    if (connector) {
+        json_append_string(json, connector);
+    } else {
+        g_string_append(json, "null");
+    }
+    g_string_append(json, ",\"profile\":");
+    if (filename) {
+        json_append_string(json, filename);
+    } else {
+        g_string_append(json, "null");
+    }
+    g_string_append_printf(json, ",\"gamma_tool\":%s", ours ? "true" : "false");
+    if (ours && !is_slot_profile(job->profile) &&
+        parse_settings_metadata(cd_profile_get_metadata_item(job->profile, "GAMMA_TOOL_gamma"),
+                                cd_profile_get_metadata_item(job->profile, "GAMMA_TOOL_temperature"),
+                                cd_profile_get_metadata_item(job->profile, "GAMMA_TOOL_samples"),
+                                gamma, &temperature, &n_samples)) {
+        g_string_append(json, ",\"gamma\":[");
+        for (int i = 0; i < 3; i++) {
+            if (i > 0) g_string_append_c(json, ',');
+            json_append_number(json, gamma[i]);
+        }
+        g_string_append_printf(json, "],\"temperature\":%d,\"samples\":%u}", temperature, n_samples);
+    } else {
+        g_string_append(json, ",\"gamma\":null,\"temperature\":null,\"samples\":null}");
+    }
+    job_finish(job);
+}
+
+/**
+ * @brief Handles the -i (info) mode for a single device.
+ */
+static void handle_info_mode(DeviceJob *job) {
+    if (job->args.json) {
+        handle_info_json(job);
+        return;
+    }
+    const char *profile_filename = cd_profile_get_filename(job->profile);
+    if (profile_filename == NULL) {
+        job_printf(job, "Current profile has no filename.\n");
+        job_finish(job);
+        return;
+    }
+    gchar *basename = g_path_get_basename(profile_filename);
+    gfloat gamma[3];
+    gint temperature;
+    guint n_samples;
+    if (g_str_has_prefix(basename, OUR_PREFIX) && profile_get_settings(job->profile, gamma, &temperature, &n_samples)) {
+        job_printf(job, "gamma: %.2f:%.2f:%.2f\n", gamma[0], gamma[1], gamma[2]);
+        job_printf(job, "temperature: %d\n", temperature);
+    } else if (g_str_has_prefix(basename, OUR_PREFIX)) {
+        // Profiles from older versions only carry their settings in the name.
+        int r, g, b, temp;
+        int items = sscanf(basename, "gamma-tool-g%3d%3d%3dt%d-", &r, &g, &b, &temp);
+        if (items == 4) {
+            job_printf(job, "gamma: %.2f:%.2f:%.2f\n", r / 100.0f, g / 100.0f, b / 100.0f);
+            job_printf(job, "temperature: %d\n", temp);
+        } else {
+            job_printf(job, "Could not parse parameters from profile name: %s\n", basename);
+        }
+    } else {
+        job_printf(job, "Current profile is not a gamma-tool profile: %s\n", profile_filename);
+    }
+    g_free(basename);
+    job_finish(job);
+}
+
+static void on_slot_sibling_removed(GObject *source, GAsyncResult *res, gpointer user_data) {
+    DeviceJob *job = user_data;
+    gchar *sibling = slot_sibling_path(cd_profile_get_filename(job->profile));
+    // Not being attached to the device is fine; the file goes either way.
+    cd_device_remove_profile_finish(CD_DEVICE(source), res, NULL);
+    job_printf(job, "Deleting file %s\n", sibling);
+    if (remove(sibling) != 0) {
+        job_error(job, "Could not delete profile file: %s", sibling);
+    }
+    g_free(sibling);
+    job_finish(job);
+}
+
+static void on_slot_sibling_found(GObject *source, GAsyncResult *res, gpointer user_data) {
+    DeviceJob *job = user_data;
+    CdProfile *sibling = cd_client_find_profile_by_filename_finish(CD_CLIENT(source), res, NULL);
+    if (!sibling) {
+        job_finish(job);
+        return;
+    }
+    cd_device_remove_profile(job->device, sibling, NULL, on_slot_sibling_removed, job);
+    g_object_unref(sibling);
+}
+
+static void on_our_profile_removed(GObject *source, GAsyncResult *res, gpointer user_data) {
+    DeviceJob *job = user_data;
+    GError *error = NULL;
+    const char *profile_filename = cd_profile_get_filename(job->profile);
+    gboolean removed = cd_device_remove_profile_finish(CD_DEVICE(source), res, &error);
+    job_phase(job, "remove-profile");
+    if (removed) {
+        if (!job->delete_removed) {
+            job_finish(job);
+            return;
+        }
+        job_printf(job, "Deleting file %s\n", profile_filename);
+        if (remove(profile_filename) != 0) {
+            job_error(job, "Could not delete profile file: %s", profile_filename);
+        }
+        if (is_slot_profile(job->profile)) {
+            // The other slot is still attached and would become the fallback.
+            gchar *sibling = slot_sibling_path(profile_filename);
+            cd_client_find_profile_by_filename(job->run->session->client, sibling, NULL, on_slot_sibling_found, job);
+            g_free(sibling);
+            return;
+        }
+    } else {
+        job_error(job, "Could not remove profile from device: %s", error->message);
+        g_error_free(error);
+        job->run->session->stats.colord_errors++;
+    }
+    job_finish(job);
+}
+
+/**
+ * @brief Detaches the job's current (gamma-tool) profile, optionally deleting its file.
+ *
+ * Deleting a slot profile also detaches and deletes the device's other slot.
+ */
+static void remove_our_profile(DeviceJob *job, gboolean delete_file) {
+    job->delete_removed = delete_file;
+    cd_device_remove_profile(job->device, job->profile, NULL, on_our_profile_removed, job);
+}
+
+/**
+ * @brief Handles the -r (remove) mode for a single device.
+ */
+static void handle_remove_mode(DeviceJob *job) {
+    const char *profile_filename = cd_profile_get_filename(job->profile);
+    job_printf(job, "Current profile is %s\n", profile_filename ? profile_filename : cd_profile_get_id(job->profile));
+
+    if (is_gamma_tool_profile(job->profile)) {
+        job_printf(job, "Removing profile from device...\n");
+        remove_our_profile(job, TRUE);
+    } else {
+        job_printf(job, "Current profile was not created by this tool. Not removing.\n");
+        job_finish(job);
+    }
+}
+
+/**
+ * @brief Final step of apply mode: drops the previous gamma-tool profile if we replaced it.
+ *
+ * Profiles tracked by the profile cache only lose their device relation; the
+ * file stays on disk for reuse until profile_cache_prune() evicts it. When
+ * flipping between --slots profiles the old slot stays attached for next time.
+ */
+static void finish_apply(DeviceJob *job) {
+    if (!job->new_profile) {
+        run_release_shared_profile(job);
+    }
+    gboolean flipped_slot = job->args.slots && is_slot_profile(job->profile);
+    gboolean reapplied = job->new_profile &&
+        g_strcmp0(cd_profile_get_object_path(job->new_profile), cd_profile_get_object_path(job->profile)) == 0;
+    if (job->is_our_profile && job->new_profile && !flipped_slot && !reapplied) {
+        job_printf(job, "Removing old profile...\n");
+        remove_our_profile(job, !profile_cache_contains(cd_profile_get_filename(job->profile)));
+    } else {
+        job_finish(job);
+    }
+}
+
+static void on_new_profile_default(GObject *source, GAsyncResult *res, gpointer user_data) {
+    DeviceJob *job = user_data;
+    if (!cd_device_make_profile_default_finish(CD_DEVICE(source), res, NULL)) {
+        job_error(job, "Failed to make new profile default.");
+        job->run->session->stats.colord_errors++;
+    } else {
+        // The CRTC shows the profile again, whatever --direct set before.
+        g_hash_table_remove(job->run->session->direct_settings, cd_device_get_id(job->device));
+    }
+    job_phase(job, "make-default");
+    finish_apply(job);
+}
+
+static void on_new_profile_added(GObject *source, GAsyncResult *res, gpointer user_data) {
+    DeviceJob *job = user_data;
+    GError *error = NULL;
+    job->added_profile = cd_device_add_profile_finish(CD_DEVICE(source), res, &error);
+    // A reused profile may still be attached, which is fine.
+    if (!job->added_profile && !g_error_matches(error, CD_DEVICE_ERROR, CD_DEVICE_ERROR_PROFILE_ALREADY_ADDED)) {
+        job_error(job, "Failed to add new profile to device: %s", error->message);
+        g_error_free(error);
+        job->run->session->stats.colord_errors++;
+        g_clear_object(&job->new_profile);
+        finish_apply(job);
+        return;
+    }
+    g_clear_error(&error);
+    job_phase(job, "add-profile");
+    // Prepared: the profile is written, registered and attached. Switching to
+    // it waits until every other display of the run is this far.
+    job->prepared = TRUE;
+    if (!job->run->prepared) job->run->prepared = g_ptr_array_new();
+    g_ptr_array_add(job->run->prepared, job);
+    job_leave_transaction(job, FALSE);
+}
+
+static void on_rollback_profile_removed(GObject *source, GAsyncResult *res, gpointer user_data) {
+    DeviceJob *job = user_data;
+    GError *error = NULL;
+    if (!cd_device_remove_profile_finish(CD_DEVICE(source), res, &error)) {
+        job_error(job, "Could not detach %s: %s", cd_profile_get_filename(job->new_profile), error->message);
+        g_error_free(error);
+        job->run->session->stats.colord_errors++;
+    }
+    job_phase(job, "rollback");
+    job_finish(job);
+}
+
+/**
+ * @brief The commit phase, once no apply job of the run is still preparing.
+ *
+ * If every display got its profile ready, they are all made the default back
+ * to back, so the monitors switch together instead of as each one finishes.
+ * If any failed, no default is changed and the profiles we attached are
+ * detached again, leaving every display as it was.
+ */
+static void run_end_prepare(RunContext *run) {
+    GPtrArray *prepared = run->prepared;
+    run->prepared = NULL;
+    // Also when no display got as far as being prepared, e.g. a single one that failed.
+    if (run->prepare_failed) {
+        g_string_append(run->errors, "Error: Not every display could be prepared; no display was changed.\n");
+        run->status = 1;
+    }
+    if (!prepared) {
+        return;
+    }
+    for (guint i = 0; i < prepared->len; i++) {
+        DeviceJob *job = g_ptr_array_index(prepared, i);
+        job_phase(job, "prepare-wait");
+        if (!run->prepare_failed) {
+            cd_device_make_profile_default(job->device, job->new_profile, NULL, on_new_profile_default, job);
+        } else if (job->added_profile) {
+            job_printf(job, "Rolling back\n");
+            cd_device_remove_profile(job->device, job->new_profile, NULL, on_rollback_profile_removed, job);
+        } else {
+            job_printf(job, "Rolling back\n");
+            job_finish(job);
+        }
+    }
+    g_ptr_array_unref(prepared);
+}
+
+static void shared_profile_free(SharedProfile *shared) {
+    g_ptr_array_free(shared->waiting, TRUE);
+    g_free(shared);
+}
+
+/**
+ * @brief Parks the job behind another display of the run that is making the same file.
+ * @return TRUE if the job now waits; FALSE if it is the first and should make the profile.
+ */
+static gboolean run_share_profile(DeviceJob *job) {
+    RunContext *run = job->run;
+    if (!run->shared_profiles) {
+        run->shared_profiles = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)shared_profile_free);
+    }
+    SharedProfile *shared = g_hash_table_lookup(run->shared_profiles, job->new_path);
+    if (shared) {
+        g_ptr_array_add(shared->waiting, job);
+        return TRUE;
+    }
+    shared = g_new(SharedProfile, 1);
+    shared->leader = job;
+    shared->waiting = g_ptr_array_new();
+    g_hash_table_insert(run->shared_profiles, g_strdup(job->new_path), shared);
+    return FALSE;
+}
+
+static void apply_cached_or_build(DeviceJob *job, CdIcc *profile_data);
+
+/**
+ * @brief Called by a leader once it has a connected profile, or has given up.
+ *
+ * On success every waiting display attaches the same CdProfile. On failure the
+ * first waiting one takes over, so they still don't all write the file at once.
+ */
+static void run_release_shared_profile(DeviceJob *job) {
+    SharedProfile *shared = job->run->shared_profiles && job->new_path ?
+                            g_hash_table_lookup(job->run->shared_profiles, job->new_path) : NULL;
+    if (!shared || shared->leader != job) {
+        return;
+    }
+    if (job->new_profile) {
+        GPtrArray *waiting = g_ptr_array_ref(shared->waiting);
+        g_hash_table_remove(job->run->shared_profiles, job->new_path);
+        for (guint i = 0; i < waiting->len; i++) {
+            DeviceJob *other = g_ptr_array_index(waiting, i);
+            other->new_profile = g_object_ref(job->new_profile);
+            job_phase(other, "shared-profile");
+            register_new_profile(other);
+        }
+        g_ptr_array_unref(waiting);
+    } else if (shared->waiting->len > 0) {
+        shared->leader = g_ptr_array_index(shared->waiting, 0);
+        g_ptr_array_remove_index(shared->waiting, 0);
+        apply_cached_or_build(shared->leader, NULL);
+    } else {
+        g_hash_table_remove(job->run->shared_profiles, job->new_path);
+    }
+}
+
+/**
+ * @brief Attaches a discovered, connected profile to the device and makes it the default.
+ */
+static void register_new_profile(DeviceJob *job) {
+    run_release_shared_profile(job);
+    job_printf(job, "New profile is %s\n", cd_profile_get_filename(job->new_profile));
+    cd_device_add_profile(job->device, CD_DEVICE_RELATION_HARD, job->new_profile, NULL, on_new_profile_added, job);
+}
+
+static void on_new_profile_connected(GObject *source, GAsyncResult *res, gpointer user_data) {
+    DeviceJob *job = user_data;
+    GError *error = NULL;
+    if (!cd_profile_connect_finish(CD_PROFILE(source), res, &error)) {
+        job_error(job, "Could not connect to new profile: %s", error->message);
+        g_error_free(error);
+        job->run->session->stats.colord_errors++;
+        finish_apply(job);
+        return;
+    }
+    session_cache_profile(job->run->session, job->new_profile);
+    job_phase(job, "new-profile-connect");
+    register_new_profile(job);
+}
+
+/**
+ * @brief Returns the file the typical discovery latency is kept in, next to the LRU index.
+ */
+static gchar *discovery_latency_path(void) {
+    return g_build_filename(g_get_user_cache_dir(), "gamma-tool", "discovery-latency", NULL);
+}
+
+/**
+ * @brief Returns the typical time colord takes to discover a new profile, in microseconds.
+ *
+ * Read from the cache dir on first use, so one-shot runs learn from earlier ones.
+ * @return 0 if nothing was learned yet.
+ */
+static gint64 session_discovery_latency(Session *session) {
+    if (!session->discovery_latency_loaded) {
+        session->discovery_latency_loaded = TRUE;
+        gchar *path = discovery_latency_path();
+        gchar *contents = NULL;
+        if (g_file_get_contents(path, &contents, NULL, NULL)) {
+            gint64 latency = g_ascii_strtoll(contents, NULL, 10);
+            session->discovery_latency = MAX(latency, 0);
+            g_free(contents);
+        }
+        g_free(path);
+    }
+    return session->discovery_latency;
+}
+
+static void discovery_latency_save(Session *session) {
+    gchar *path = discovery_latency_path();
+    gchar *dir = g_path_get_dirname(path);
+    g_mkdir_with_parents(dir, 0755);
+    gchar *contents = g_strdup_printf("%" G_GINT64_FORMAT "\n", session->discovery_latency);
+    GError *error = NULL;
+    if (!g_file_set_contents(path, contents, -1, &error)) {
+        g_warning("Could not write discovery latency %s: %s", path, error->message);
+        g_error_free(error);
+    }
+    g_free(contents);
+    g_free(dir);
+    g_free(path);
+}
+
+/**
+ * @brief Folds one discovery wait into the session's typical latency.
+ *
+ * A wait that timed out counts with the time it took, so the budget grows
+ * when colord keeps missing it.
+ */
+static void session_learn_discovery_latency(Session *session, gint64 usec) {
+    gint64 latency = session_discovery_latency(session);
+    session->discovery_latency = latency == 0 ? usec :
+        latency + (gint64)((usec - latency) * DISCOVERY_LATENCY_WEIGHT);
+}
+
+/**
+ * @brief Returns how long a run's discovery waits may take in all, in microseconds.
+ *
+ * --timeout wins. Otherwise it is TIMEOUT_SECONDS, or a multiple of the
+ * learned latency if that is longer, up to DISCOVERY_MAX_SECONDS. A fast
+ * colord never shortens it: a run is rolled back as a whole if a single
+ * display misses it.
+ */
+static gint64 run_discovery_budget(RunContext *run) {
+    if (run->args.timeout_seconds) {
+        return (gint64)run->args.timeout_seconds * G_USEC_PER_SEC;
+    }
+    gint64 learned = session_discovery_latency(run->session) * DISCOVERY_LATENCY_FACTOR;
+    return CLAMP(learned, (gint64)TIMEOUT_SECONDS * G_USEC_PER_SEC, (gint64)DISCOVERY_MAX_SECONDS * G_USEC_PER_SEC);
+}
+
+/**
+ * @brief Ends a job's discovery wait, whether colord saw the file or not.
+ * @param learn TRUE to count the wait towards the typical latency.
+ */
+static void job_end_discovery(DeviceJob *job, gboolean learn) {
+    RunContext *run = job->run;
+    gint64 now = g_get_monotonic_time();
+    run->session->discovering = g_list_remove(run->session->discovering, job);
+    if (job->timeout_id) {
+        g_source_remove(job->timeout_id);
+        job->timeout_id = 0;
+    }
+    if (learn) {
+        session_learn_discovery_latency(run->session, now - job->discovery_start);
+        stats_observe(&run->session->stats.discovery_seconds, now - job->discovery_start);
+        run->discovery_learned = TRUE;
+    }
+    if (--run->discovering == 0) {
+        run->discovery_usec += now - run->discovery_since;
+    }
+}
+
+static gboolean on_discovery_timeout(gpointer user_data) {
+    DeviceJob *job = user_data;
+    gint64 waited = g_get_monotonic_time() - job->discovery_start;
+    job->timeout_id = 0;
+    job_end_discovery(job, TRUE);
+    job_phase(job, "discovery");
+    job->run->session->stats.colord_errors++;
+    job_error(job, "Timed out after %.1f s waiting for colord to detect new profile: %s",
+              waited / (gdouble)G_USEC_PER_SEC, job->new_path);
+    finish_apply(job);
+    return G_SOURCE_REMOVE;
+}
+
+static void on_added_profile_connected(GObject *source, GAsyncResult *res, gpointer user_data) {
+    Session *session = user_data;
+    CdProfile *profile = CD_PROFILE(source);
+    if (!cd_profile_connect_finish(profile, res, NULL)) {
+        return;
+    }
+    const char *filename = cd_profile_get_filename(profile);
+    for (GList *l = session->discovering; l != NULL; l = l->next) {
+        DeviceJob *job = l->data;
+        if (g_strcmp0(job->new_path, filename) == 0) {
+            job_end_discovery(job, TRUE);
+            session_cache_profile(session, profile);
+            job->new_profile = g_object_ref(profile);
+            job_phase(job, "discovery");
+            register_new_profile(job);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief CdClient::profile-added handler, shared by every job waiting for discovery.
+ *
+ * The signal only carries an object path, so the profile is connected to learn
+ * its filename; this is the only D-Bus traffic while a job is waiting.
+ */
+static void on_profile_added(CdClient *client, CdProfile *profile, gpointer user_data) {
+    Session *session = user_data;
+    if (session->discovering == NULL) {
+        return;
+    }
+    cd_profile_connect(profile, NULL, on_added_profile_connected, session);
+}
+
+/**
+ * @brief Parks a job until colord announces the profile at job->new_path.
+ *
+ * Must be called before the file is written so the ProfileAdded signal can't be missed.
+ * The run's budget starts with its first wait and is shared by all of them,
+ * so displays waiting side by side don't add up to several timeouts.
+ */
+static void wait_for_new_profile(DeviceJob *job) {
+    RunContext *run = job->run;
+    Session *session = run->session;
+    if (session->profile_added_id == 0) {
+        session->profile_added_id = g_signal_connect(session->client, "profile-added", G_CALLBACK(on_profile_added), session);
+    }
+    job->discovery_start = g_get_monotonic_time();
+    if (run->discovery_deadline == 0) {
+        run->discovery_deadline = job->discovery_start + run_discovery_budget(run);
+    }
+    if (run->discovering++ == 0) {
+        run->discovery_since = job->discovery_start;
+    }
+    session->discovering = g_list_prepend(session->discovering, job);
+    gint64 remaining = MAX(run->discovery_deadline - job->discovery_start, 0);
+    job->timeout_id = g_timeout_add((guint)((remaining + 999) / 1000), on_discovery_timeout, job);
+}
+
+/**
+ * @brief Abandons a wait started by wait_for_new_profile(), e.g. when the write failed.
+ */
+static void cancel_wait_for_new_profile(DeviceJob *job) {
+    job_end_discovery(job, FALSE);
+}
+
+/**
+ * @brief Looks up the job's CRTC by connector name in the run's Mutter resources.
+ */
+static const CrtcInfo *job_get_crtc(DeviceJob *job) {
+    const char *connector = cd_device_get_metadata_item(job->device, CD_DEVICE_METADATA_XRANDR_NAME);
+    return connector && job->run->crtcs ? g_hash_table_lookup(job->run->crtcs, connector) : NULL;
+}
+
+/**
+ * @brief Picks the LUT resolution for a job, honouring -n auto where Mutter reported one.
+ */
+static guint job_n_samples(DeviceJob *job) {
+    AppArgs *args = &job->args;
+    if (job->run->crtcs && args->auto_samples) {
+        const CrtcInfo *crtc = job_get_crtc(job);
+        guint size = crtc ? crtc->gamma_size : 0;
+        if (size >= 2 && size <= MAX_SAMPLES) {
+            return size;
+        }
+    }
+    return args->n_samples;
+}
+
+static void build_new_profile(DeviceJob *job, CdIcc *profile_data);
+
+static void on_cached_profile_found(GObject *source, GAsyncResult *res, gpointer user_data) {
+    DeviceJob *job = user_data;
+    Session *session = job->run->session;
+    CdProfile *found = cd_client_find_profile_by_filename_finish(CD_CLIENT(source), res, NULL);
+    job_phase(job, "find-profile");
+    if (!found) {
+        // colord lost track of the file; write it again so it is rediscovered.
+        remove(job->new_path);
+        build_new_profile(job, NULL);
+        return;
+    }
+    CdProfile *cached = g_hash_table_lookup(session->profiles, cd_profile_get_object_path(found));
+    if (cached) {
+        job->new_profile = g_object_ref(cached);
+        g_object_unref(found);
+        register_new_profile(job);
+    } else {
+        job->new_profile = found;
+        cd_profile_connect(job->new_profile, NULL, on_new_profile_connected, job);
+    }
+}
+
+/**
+ * @brief Stamps the description and GAMMA_TOOL_* metadata of a generated profile.
+ * @param base_checksum The base's checksum, or NULL to use that of profile_data.
+ * @param uuid The cache key, which doubles as the uuid: unique per content and deterministic.
+ */
+static void set_profile_metadata(CdIcc *profile_data, const AppArgs *args, guint n_samples,
+                                 const char *base, const char *base_checksum, const char *uuid) {
+    gchar *title = g_strdup_printf("gamma-tool: g=%.2f:%.2f:%.2f t=%d", args->gamma[0], args->gamma[1], args->gamma[2], args->temperature);
+    cd_icc_set_description(profile_data, "", title);
+    g_free(title);
+
+    cd_icc_add_metadata(profile_data, "uuid", uuid);
+    if (base) cd_icc_add_metadata(profile_data, "GAMMA_TOOL_base", base);
+    gchar *value = g_strdup_printf("%.9g:%.9g:%.9g", args->gamma[0], args->gamma[1], args->gamma[2]);
+    cd_icc_add_metadata(profile_data, "GAMMA_TOOL_gamma", value);
+    g_free(value);
+    value = g_strdup_printf("%d", args->temperature);
+    cd_icc_add_metadata(profile_data, "GAMMA_TOOL_temperature", value);
+    g_free(value);
+    value = g_strdup_printf("%u", n_samples);
+    cd_icc_add_metadata(profile_data, "GAMMA_TOOL_samples", value);
+    g_free(value);
+    if (!base_checksum) base_checksum = cd_icc_get_checksum(profile_data);
+    if (base_checksum) cd_icc_add_metadata(profile_data, "GAMMA_TOOL_base_checksum", base_checksum);
+}
+
+static void on_slot_profile_connected(GObject *source, GAsyncResult *res, gpointer user_data) {
+    DeviceJob *job = user_data;
+    GError *error = NULL;
+    if (!cd_profile_connect_finish(CD_PROFILE(source), res, &error)) {
+        job_error(job, "Could not connect to profile slot: %s", error->message);
+        g_error_free(error);
+        job->run->session->stats.colord_errors++;
+        g_clear_object(&job->new_profile);
+        finish_apply(job);
+        return;
+    }
+    session_cache_profile(job->run->session, job->new_profile);
+    job_phase(job, "new-profile-connect");
+    build_new_profile(job, NULL);
+}
+
+static void on_slot_profile_found(GObject *source, GAsyncResult *res, gpointer user_data) {
+    DeviceJob *job = user_data;
+    Session *session = job->run->session;
+    CdProfile *found = cd_client_find_profile_by_filename_finish(CD_CLIENT(source), res, NULL);
+    job_phase(job, "find-profile");
+    if (!found) {
+        // colord doesn't know the slot (yet); write it afresh and wait for it.
+        remove(job->new_path);
+        build_new_profile(job, NULL);
+        return;
+    }
+    CdProfile *cached = g_hash_table_lookup(session->profiles, cd_profile_get_object_path(found));
+    if (cached) {
+        job->new_profile = g_object_ref(cached);
+        g_object_unref(found);
+        build_new_profile(job, NULL);
+    } else {
+        job->new_profile = found;
+        cd_profile_connect(job->new_profile, NULL, on_slot_profile_connected, job);
+    }
+}
+
+/**
+ * @brief Generates the profile for job->new_path, writes it and waits for colord.
+ *
+ * If job->new_profile is already set, the path is a --slots profile colord
+ * already knows, so the file is rewritten in place and no discovery is needed.
+ * @param profile_data The base ICC data, or NULL to fetch it from the session.
+ */
+static void build_new_profile(DeviceJob *job, CdIcc *profile_data) {
+    AppArgs *args = &job->args;
+    Session *session = job->run->session;
+    GError *error = NULL;
+    if (profile_data) g_object_ref(profile_data);
+
+    const char *base, *base_checksum;
+    profile_get_base(job->profile, &base, &base_checksum);
+    if (!base_checksum && profile_data) base_checksum = cd_icc_get_checksum(profile_data);
+
+    // The base is serialized once per LUT size; after that a profile is a copy
+    // of the template with the settings and ramp patched in, and the base ICC
+    // isn't even needed.
+    gchar *template_key = g_strdup_printf("%s|%u", base_checksum ? base_checksum : base, job->n_samples);
+    IccTemplate *template = g_hash_table_lookup(session->templates, template_key);
+    if (!template) {
+        if (!profile_data) {
+            profile_data = session_get_base_icc(session, job->profile, &error);
+            if (!profile_data) {
+                job_error(job, "Could not get ICC data from base profile: %s", error->message);
+                g_error_free(error);
+                g_free(template_key);
+                g_clear_object(&job->new_profile);
+                finish_apply(job); // Releases any displays sharing this profile
+                return;
+            }
+            job_phase(job, "load-icc");
+        }
+        template = icc_template_new(profile_data, job->n_samples, base, base_checksum, &error);
+        if (template) {
+            g_hash_table_insert(session->templates, template_key, template);
+            template_key = NULL;
+        } else {
+            g_debug("No ICC template, serializing every profile: %s", error->message);
+            g_clear_error(&error);
+        }
+        job_phase(job, "template");
+    }
+    g_free(template_key);
+
+    VcgtRamp *ramp = vcgt_compute(args->gamma, args->temperature, job->n_samples);
+    GBytes *data = template ? icc_template_render(template, args->gamma, args->temperature, job->cache_key, ramp) : NULL;
+    if (!data) {
+        if (!profile_data) profile_data = session_get_base_icc(session, job->profile, &error);
+        if (profile_data) {
+            set_profile_metadata(profile_data, args, job->n_samples, base, base_checksum, job->cache_key);
+            if (set_vcgt_from_ramp(profile_data, ramp, &error)) {
+                data = serialize_profile(profile_data, ramp, &error);
+            }
+        }
+        if (!data) {
+            job_error(job, "Could not build new profile: %s", error->message);
+            g_error_free(error);
+            g_free(ramp);
+            if (profile_data) g_object_unref(profile_data);
+            g_clear_object(&job->new_profile);
+            finish_apply(job);
+            return;
+        }
+    }
+    g_free(ramp);
+    job_phase(job, "generate-vcgt");
+
+    if (job->new_profile) {
+        // An existing slot colord already knows: rewrite it and flip the default.
+        if (!write_profile(data, job->new_path, TRUE, &error)) {
+            job_error(job, "Could not save new profile to %s: %s", job->new_path, error->message);
+            g_error_free(error);
+            g_clear_object(&job->new_profile);
+            finish_apply(job);
+        } else {
+            job_phase(job, "save");
+            register_new_profile(job);
+        }
+    } else {
+        wait_for_new_profile(job);
+        if (!write_profile(data, job->new_path, FALSE, &error)) {
+            job_error(job, "Could not save new profile to %s: %s", job->new_path, error->message);
+            g_error_free(error);
+            cancel_wait_for_new_profile(job);
+            finish_apply(job);
+        } else {
+            job_phase(job, "save");
+            if (!args->slots) profile_cache_touch(job->new_path);
+        }
+    }
+
+    g_bytes_unref(data);
+    if (profile_data) g_object_unref(profile_data);
+}
+
+/**
+ * @brief Returns TRUE if --direct left the display at other settings than the job's.
+ *
+ * The CRTC then doesn't show the default profile, so an apply that would
+ * otherwise be a no-op has to make the profile the default again.
+ */
+static gboolean job_direct_differs(DeviceJob *job) {
+    DirectSettings *direct = g_hash_table_lookup(job->run->session->direct_settings, cd_device_get_id(job->device));
+    if (!direct || g_strcmp0(direct->profile_path, cd_profile_get_object_path(job->profile)) != 0) {
+        return FALSE;
+    }
+    return direct->gamma[0] != job->args.gamma[0] || direct->gamma[1] != job->args.gamma[1] ||
+           direct->gamma[2] != job->args.gamma[2] || direct->temperature != job->args.temperature;
+}
+
+/**
+ * @brief Makes the device's current profile its default again, replacing a --direct ramp.
+ */
+static void job_reapply_profile(DeviceJob *job) {
+    job_printf(job, "Profile is already active, restoring it over the --direct settings.\n");
+    job->new_profile = g_object_ref(job->profile);
+    register_new_profile(job);
+}
+
+/**
+ * @brief Handles the default mode: creating and applying a new profile.
+ *
+ * Profiles are content-addressed by a hash of the base profile checksum and
+ * the settings. If that file already exists it is reused as is, skipping the
+ * ICC load, VCGT generation and write; only the default profile is switched.
+ * With --slots the inactive one of two per-device files is rewritten instead.
+ * Otherwise it is generated and written here, colord discovery is signalled
+ * through CdClient::profile-added, and registration and the switch-over
+ * continue in the callbacks above.
+ */
+static void handle_apply_mode(DeviceJob *job) {
+    AppArgs *args = &job->args;
+    CdProfile *profile = job->profile;
+    const char *profile_filename = cd_profile_get_filename(profile);
+    job_printf(job, "Current profile is %s\n", profile_filename ? profile_filename : cd_profile_get_id(profile));
+
+    job->is_our_profile = is_gamma_tool_profile(profile);
+    job->n_samples = job_n_samples(job);
+    if (job->n_samples != args->n_samples) {
+        job_printf(job, "Using the CRTC's %u-entry gamma ramp\n", job->n_samples);
+    }
+
+    gfloat current_gamma[3];
+    gint current_temperature;
+    guint current_samples;
+    if (job->is_our_profile &&
+        profile_get_settings(profile, current_gamma, &current_temperature, &current_samples) &&
+        current_gamma[0] == args->gamma[0] && current_gamma[1] == args->gamma[1] &&
+        current_gamma[2] == args->gamma[2] &&
+        current_temperature == args->temperature && current_samples == job->n_samples) {
+        if (job_direct_differs(job)) {
+            job_reapply_profile(job);
+            return;
+        }
+        job_printf(job, "Profile is already active.\n");
+        job->run->session->stats.noop_skips++;
+        job_leave_transaction(job, FALSE);
+        job_finish(job);
+        return;
+    }
+
+    GError *error = NULL;
+    CdIcc *profile_data = NULL;
+    const char *base, *base_checksum;
+    profile_get_base(profile, &base, &base_checksum);
+    if (!base_checksum) {
+        // colord didn't record a checksum, so the base has to be loaded for the key.
+        profile_data = session_get_base_icc(job->run->session, profile, &error);
+        if (!profile_data) {
+            job_error(job, "Could not get ICC data from base profile: %s", error->message);
+            g_error_free(error);
+            job->run->session->stats.colord_errors++;
+            job_finish(job);
+            return;
+        }
+        base_checksum = cd_icc_get_checksum(profile_data);
+        job_phase(job, "load-icc");
+    }
+    job->cache_key = profile_cache_key(base_checksum, args->gamma, args->temperature, job->n_samples);
+
+    gchar *icc_dir = g_build_filename(g_get_user_data_dir(), "icc", NULL);
+    g_mkdir_with_parents(icc_dir, 0755);
+    gchar *new_basename;
+    if (args->slots) {
+        // Two stable files per device; write whichever one isn't the default.
+        gchar *device_hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, cd_device_get_id(job->device), -1);
+        gchar *slot_a = g_strdup_printf("%s%.12s-a.icc", SLOT_PREFIX, device_hash);
+        gchar *current = profile_filename ? g_path_get_basename(profile_filename) : NULL;
+        new_basename = g_strcmp0(current, slot_a) == 0 ? g_strdup_printf("%s%.12s-b.icc", SLOT_PREFIX, device_hash) : g_strdup(slot_a);
+        g_free(current); g_free(slot_a); g_free(device_hash);
+    } else {
+        int r = (int)(args->gamma[0] * 100.0f); int g = (int)(args->gamma[1] * 100.0f); int b = (int)(args->gamma[2] * 100.0f);
+        new_basename = g_strdup_printf("%sg%03d%03d%03dt%d-%.32s.icc",
+                                       OUR_PREFIX, r, g, b, args->temperature, job->cache_key);
+    }
+    job->new_path = g_build_filename(icc_dir, new_basename, NULL);
+    g_free(new_basename); g_free(icc_dir);
+
+    if (args->slots) {
+        if (g_file_test(job->new_path, G_FILE_TEST_IS_REGULAR)) {
+            cd_client_find_profile_by_filename(job->run->session->client, job->new_path, NULL, on_slot_profile_found, job);
+        } else {
+            build_new_profile(job, profile_data);
+        }
+    } else if (g_strcmp0(job->new_path, profile_filename) == 0 && job_direct_differs(job)) {
+        job_reapply_profile(job);
+    } else if (g_strcmp0(job->new_path, profile_filename) == 0) {
+        job_printf(job, "Profile is already active.\n");
+        job->run->session->stats.noop_skips++;
+        profile_cache_touch(job->new_path);
+        job_leave_transaction(job, FALSE);
+        job_finish(job);
+    } else if (run_share_profile(job)) {
+        job_printf(job, "Same profile as another display, waiting for it\n");
+    } else {
+        apply_cached_or_build(job, profile_data);
+    }
+    if (profile_data) g_object_unref(profile_data);
+}
+
+/**
+ * @brief Switches to the content-addressed profile at job->new_path, writing it first if needed.
+ */
+static void apply_cached_or_build(DeviceJob *job, CdIcc *profile_data) {
+    if (g_file_test(job->new_path, G_FILE_TEST_IS_REGULAR)) {
+        job_printf(job, "Reusing cached profile\n");
+        job->run->session->stats.cache_hits++;
+        profile_cache_touch(job->new_path);
+        cd_client_find_profile_by_filename(job->run->session->client, job->new_path, NULL, on_cached_profile_found, job);
+    } else {
+        job->run->session->stats.cache_misses++;
+        build_new_profile(job, profile_data);
+    }
+}
+
+/**
+ * @brief Computes the content address of a generated profile.
+ * @return A newly allocated SHA-256 hex digest.
+ */
+static gchar *profile_cache_key(const char *base_checksum, const gfloat gamma[3], gint temperature, guint n_samples) {
+    gchar *material = g_strdup_printf("%s|%.9g|%.9g|%.9g|%d|%u", base_checksum ? base_checksum : "",
+                                      gamma[0], gamma[1], gamma[2], temperature, n_samples);
+    gchar *key = g_compute_checksum_for_string(G_CHECKSUM_SHA256, material, -1);
+    g_free(material);
+    return key;
+}
+
+/**
+ * @brief Returns the path of the LRU index for generated profiles.
+ *
+ * The index lists profile basenames, most recently used first. It lives in the
+ * cache dir rather than as mtimes in the icc dir so that touching an entry
+ * doesn't wake colord's directory watcher.
+ */
+static gchar *profile_cache_index_path(void) {
+    return g_build_filename(g_get_user_cache_dir(), "gamma-tool", "profiles.lru", NULL);
+}
+
+static GPtrArray *profile_cache_load(void) {
+    GPtrArray *entries = g_ptr_array_new_with_free_func(g_free);
+    gchar *index_path = profile_cache_index_path();
+    gchar *contents = NULL;
+    if (g_file_get_contents(index_path, &contents, NULL, NULL)) {
+        gchar **lines = g_strsplit(contents, "\n", -1);
+        for (gchar **line = lines; *line; line++) {
+            if (g_str_has_prefix(*line, OUR_PREFIX)) {
+                g_ptr_array_add(entries, g_strdup(*line));
+            }
+        }
+        g_strfreev(lines);
+        g_free(contents);
+    }
+    g_free(index_path);
+    return entries;
+}
+
+static void profile_cache_save(GPtrArray *entries) {
+    gchar *index_path = profile_cache_index_path();
+    gchar *dir = g_path_get_dirname(index_path);
+    g_mkdir_with_parents(dir, 0755);
+    GString *contents = g_string_new(NULL);
+    for (guint i = 0; i < entries->len; i++) {
+        g_string_append_printf(contents, "%s\n", (const char *)g_ptr_array_index(entries, i));
+    }
+    GError *error = NULL;
+    if (!g_file_set_contents(index_path, contents->str, contents->len, &error)) {
+        g_warning("Could not write profile cache index %s: %s", index_path, error->message);
+        g_error_free(error);
+    }
+    g_string_free(contents, TRUE);
+    g_free(dir);
+    g_free(index_path);
+}
+
+static gboolean profile_cache_find(GPtrArray *entries, const char *basename, guint *index) {
+    for (guint i = 0; i < entries->len; i++) {
+        if (g_strcmp0(g_ptr_array_index(entries, i), basename) == 0) {
+            *index = i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * @brief Returns TRUE if a profile file is tracked by the profile cache.
+ */
+static gboolean profile_cache_contains(const char *path) {
+    if (path == NULL) {
+        return FALSE;
+    }
+    GPtrArray *entries = profile_cache_load();
+    gchar *basename = g_path_get_basename(path);
+    guint index;
+    gboolean found = profile_cache_find(entries, basename, &index);
+    g_free(basename);
+    g_ptr_array_free(entries, TRUE);
+    return found;
+}
+
+/**
+ * @brief Loads the profile cache index as a set of basenames, for many lookups at once.
+ */
+static GHashTable *profile_cache_load_set(void) {
+    GPtrArray *entries = profile_cache_load();
+    GHashTable *set = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for (guint i = 0; i < entries->len; i++) {
+        g_hash_table_add(set, g_strdup(g_ptr_array_index(entries, i)));
+    }
+    g_ptr_array_free(entries, TRUE);
+    return set;
+}
+
+/**
+ * @brief Returns TRUE if path's file is in a set from profile_cache_load_set().
+ */
+static gboolean profile_cache_set_contains(GHashTable *set, const char *path) {
+    gchar *basename = g_path_get_basename(path);
+    gboolean found = g_hash_table_contains(set, basename);
+    g_free(basename);
+    return found;
+}
+
+/**
+ * @brief Marks a generated profile as most recently used.
+ */
+static void profile_cache_touch(const char *path) {
+    GPtrArray *entries = profile_cache_load();
+    gchar *basename = g_path_get_basename(path);
+    guint index;
+    if (profile_cache_find(entries, basename, &index)) {
+        if (index == 0) {
+            g_free(basename);
+            g_ptr_array_free(entries, TRUE);
+            return;
+        }
+        g_ptr_array_remove_index(entries, index);
+    }
+    g_ptr_array_insert(entries, 0, basename);
+    profile_cache_save(entries);
+    g_ptr_array_free(entries, TRUE);
+}
+
+/**
+ * @brief Returns the filename of a device's profile, connecting it if it isn't cached.
+ */
+static const char *session_get_profile_filename(Session *session, CdProfile *profile) {
+    CdProfile *cached = g_hash_table_lookup(session->profiles, cd_profile_get_object_path(profile));
+    if (!cached && cd_profile_connect_sync(profile, NULL, NULL)) {
+        session_cache_profile(session, profile);
+        cached = profile;
+    }
+    return cached ? cd_profile_get_filename(cached) : NULL;
+}
+
+/**
+ * @brief Collects the filenames of the default profiles of all known devices.
+ */
+static GHashTable *session_get_active_filenames(Session *session) {
+    GHashTable *active = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for (GList *l = session_get_devices(session); l != NULL; l = l->next) {
+        GPtrArray *profiles = cd_device_get_profiles(l->data);
+        if (profiles != NULL && profiles->len > 0) {
+            const char *filename = session_get_profile_filename(session, g_ptr_array_index(profiles, 0));
+            if (filename) {
+                g_hash_table_add(active, g_strdup(filename));
+            }
+        }
+        if (profiles) g_ptr_array_free(profiles, TRUE);
+    }
+    return active;
+}
+
+/**
+ * @brief Evicts least recently used profiles beyond CACHE_MAX_PROFILES.
+ *
+ * Profiles that are still the default of some device are never evicted.
+ * Deleting the file is enough for colord to drop the profile.
+ */
+static void profile_cache_prune(Session *session) {
+    GPtrArray *entries = profile_cache_load();
+    if (entries->len <= CACHE_MAX_PROFILES) {
+        g_ptr_array_free(entries, TRUE);
+        return;
+    }
+    gchar *icc_dir = g_build_filename(g_get_user_data_dir(), "icc", NULL);
+    GHashTable *active = session_get_active_filenames(session);
+    for (guint i = entries->len; i > CACHE_MAX_PROFILES; i--) {
+        gchar *path = g_build_filename(icc_dir, g_ptr_array_index(entries, i - 1), NULL);
+        if (!g_hash_table_contains(active, path)) {
+            if (remove(path) == 0) {
+                session->stats.gc_files++;
+            } else if (errno != ENOENT) {
+                g_warning("Could not delete cached profile %s", path);
+            }
+            g_ptr_array_remove_index(entries, i - 1);
+        }
+        g_free(path);
+    }
+    profile_cache_save(entries);
+    g_hash_table_unref(active);
+    g_free(icc_dir);
+    g_ptr_array_free(entries, TRUE);
+}
+
+// One stale profile that --gc detaches from a device before (maybe) deleting it.
+typedef struct {
+    RunContext *run;
+    gchar *path;
+    gboolean delete_file;
+} GcRemoval;
+
+static void on_gc_profile_removed(GObject *source, GAsyncResult *res, gpointer user_data) {
+    GcRemoval *removal = user_data;
+    GError *error = NULL;
+    if (!cd_device_remove_profile_finish(CD_DEVICE(source), res, &error)) {
+        g_string_append_printf(removal->run->errors, "Could not detach %s from %s: %s\n",
+                               removal->path, cd_device_get_id(CD_DEVICE(source)), error->message);
+        g_error_free(error);
+    } else if (removal->delete_file) {
+        g_string_append_printf(removal->run->output, "Deleting file %s\n", removal->path);
+        if (remove(removal->path) == 0) {
+            removal->run->session->stats.gc_files++;
+        } else if (errno != ENOENT) {
+            g_string_append_printf(removal->run->errors, "Could not delete profile file: %s\n", removal->path);
+        }
+    }
+    run_release(removal->run);
+    g_free(removal->path);
+    g_free(removal);
+}
+
+/**
+ * @brief Handles --gc: removes gamma-tool profiles that nothing is using.
+ *
+ * The icc directory is scanned once and checked against the profiles of all
+ * display devices. Kept are every device's default profile, the other slot of
+ * a default --slots profile, and files in the profile cache index. Stale
+ * profiles still attached to a device are detached (and then deleted) with
+ * all removals in flight at once; unattached stale files, including leftover
+ * temporary files, are deleted directly.
+ */
+static void run_gc(RunContext *run) {
+    Session *session = run->session;
+    GHashTable *keep = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GHashTable *handled = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GHashTable *cached = profile_cache_load_set(); // Read once, not per profile
+    gchar *icc_dir = g_build_filename(g_get_user_data_dir(), "icc", NULL);
+
+    GHashTable *active = session_get_active_filenames(session);
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, active);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        g_hash_table_add(keep, g_strdup(key));
+        gchar *basename = g_path_get_basename(key);
+        if (g_str_has_prefix(basename, SLOT_PREFIX)) {
+            g_hash_table_add(keep, slot_sibling_path(key));
+        }
+        g_free(basename);
+    }
+    g_hash_table_unref(active);
+
+    // Stale attachments: ours, but neither a default nor its slot sibling.
+    gboolean detaching = FALSE;
+    for (GList *l = session_get_devices(session); l != NULL; l = l->next) {
+        GPtrArray *profiles = cd_device_get_profiles(l->data);
+        for (guint i = 0; profiles != NULL && i < profiles->len; i++) {
+            const char *filename = session_get_profile_filename(session, g_ptr_array_index(profiles, i));
+            gchar *basename = filename ? g_path_get_basename(filename) : NULL;
+            if (basename && g_str_has_prefix(basename, OUR_PREFIX) && !g_hash_table_contains(keep, filename)) {
+                GcRemoval *removal = g_new0(GcRemoval, 1);
+                removal->run = run;
+                removal->path = g_strdup(filename);
+                removal->delete_file = !profile_cache_set_contains(cached, filename);
+                g_hash_table_add(handled, g_strdup(filename));
+                g_string_append_printf(run->output, "Detaching %s from %s\n", filename, cd_device_get_id(l->data));
+                run->pending++;
+                detaching = TRUE;
+                cd_device_remove_profile(l->data, g_ptr_array_index(profiles, i), NULL, on_gc_profile_removed, removal);
+            }
+            g_free(basename);
+        }
+        if (profiles) g_ptr_array_free(profiles, TRUE);
+    }
+
+    guint deleted = 0;
+    GDir *dir = g_dir_open(icc_dir, 0, NULL);
+    const gchar *name;
+    while (dir && (name = g_dir_read_name(dir)) != NULL) {
+        gboolean leftover_tmp = name[0] == '.' && g_str_has_prefix(name + 1, OUR_PREFIX);
+        if (!g_str_has_prefix(name, OUR_PREFIX) && !leftover_tmp) {
+            continue;
+        }
+        gchar *path = g_build_filename(icc_dir, name, NULL);
+        if (leftover_tmp || (!g_hash_table_contains(keep, path) && !g_hash_table_contains(handled, path) &&
+                             !profile_cache_set_contains(cached, path))) {
+            g_string_append_printf(run->output, "Deleting file %s\n", path);
+            if (remove(path) == 0) {
+                deleted++;
+                session->stats.gc_files++;
+            } else {
+                g_string_append_printf(run->errors, "Could not delete profile file: %s\n", path);
+            }
+        }
+        g_free(path);
+    }
+    if (dir) g_dir_close(dir);
+    if (deleted == 0 && !detaching) {
+        g_string_append(run->output, "No stale profiles found.\n");
+    }
+
+    g_free(icc_dir);
+    g_hash_table_unref(cached);
+    g_hash_table_unref(handled);
+    g_hash_table_unref(keep);
+}
+
+/**
+ * @brief Allocates a ramp of n_samples entries per channel in a single block.
+ */
+static VcgtRamp *vcgt_ramp_new(guint n_samples) {
+    VcgtRamp *ramp = g_malloc(sizeof(VcgtRamp) + 3 * n_samples * sizeof(guint16));
+    ramp->n_samples = n_samples;
+    ramp->r = ramp->data;
+    ramp->g = ramp->data + n_samples;
+    ramp->b = ramp->data + 2 * n_samples;
+    return ramp;
+}
+
+/**
+ * @brief Quantizes a ramp value the way lcms2 does when it writes a vcgt table.
+ */
+static guint16 vcgt_quantize(gdouble value) {
+    gdouble d = value * 65535.0 + 0.5;
+    if (d <= 0.0) return 0;
+    if (d >= 65535.0) return 0xffff;
+    return (guint16)floor(d);
+}
+
+/**
+ * @brief Maps a quantized value to the middle of its step, capped at 1.0 for 0xffff.
+ */
+static gdouble vcgt_unquantize(guint16 value) {
+    return fmin((value + 0.5) / 65535.0, 1.0);
+}
+
+/**
+ * @brief Fills one channel as scale * x^exponent, using x^e = exp2(e * log2(x)).
+ *
+ * log_x holds log2(i / (n - 1)) and is shared by all three channels, so each
+ * channel costs a single exp2() per sample.
+ */
+static void vcgt_fill_channel(guint16 *restrict out, const gdouble *restrict log_x,
+                              guint n_samples, gdouble scale, gdouble exponent) {
+    for (guint i = 0; i < n_samples; i++) {
+        out[i] = vcgt_quantize(fmin(fmax(scale * exp2(exponent * log_x[i]), 0.0), 1.0));
+    }
+}
+
+/**
+ * @brief The exact, unclamped value of sample i, computed as vcgt_fill_channel() does.
+ */
+static inline gdouble vcgt_exact(guint i, gdouble inv_last, gdouble scale, gdouble exponent) {
+    return scale * exp2(exponent * log2(i * inv_last));
+}
+
+/**
+ * @brief Fills one channel of a long ramp by interpolating between exact knots.
+ *
+ * Between two knots, f(x) = scale * x^e deviates from the straight line by at
+ * most (i - k0)(k1 - i) / 2 * max|f''| at sample i, and since
+ * f'' = e(e - 1) f / x^2 that bound comes from the knots' values alone. A
+ * sample takes the interpolated value only if every value within the bound
+ * quantizes to the same 16-bit step; otherwise, and in the first segment,
+ * where f'' is unbounded, it is computed exactly. The result is therefore
+ * bit-exact with vcgt_fill_channel(), and knots are spaced by the local
+ * curvature so that few samples need the exact path.
+ */
+static void vcgt_fill_channel_knots(guint16 *restrict out, guint n_samples, gdouble scale, gdouble exponent) {
+    const guint last = n_samples - 1;
+    const gdouble inv_last = 1.0 / last;
+    const gboolean interpolate = isfinite(exponent) && exponent > 0.0;
+    const gdouble curvature = fabs(exponent * (exponent - 1.0)) * 65535.0 / 2.0; // Per sample^2
+    guint k0 = 0;
+    gdouble f0 = vcgt_exact(0, inv_last, scale, exponent);
+    while (k0 < last) {
+        out[k0] = vcgt_quantize(fmin(fmax(f0, 0.0), 1.0));
+        guint span = 1;
+        gdouble bound0 = 0.0;
+        if (interpolate && k0 > 0) {
+            bound0 = curvature * f0 / ((gdouble)k0 * k0);
+            gdouble ideal = bound0 > 0.0 ? sqrt(4.0 * VCGT_KNOT_TOLERANCE / bound0) : VCGT_KNOT_MAX_SPAN;
+            span = ideal >= VCGT_KNOT_MAX_SPAN ? VCGT_KNOT_MAX_SPAN : MAX((guint)ideal, 1);
+        }
+        guint k1 = MIN(k0 + span, last);
+        gdouble f1 = vcgt_exact(k1, inv_last, scale, exponent);
+        if (k1 > k0 + 1) {
+            gdouble bound = fmax(bound0, curvature * f1 / ((gdouble)k1 * k1));
+            const gdouble u0 = f0 * 65535.0 + 0.5;
+            const gdouble du = (f1 - f0) * 65535.0 / (k1 - k0);
+            for (guint i = k0 + 1; i < k1; i++) {
+                gdouble u = u0 + du * (i - k0);
+                // The margin covers the rounding of exp2() and of the interpolation.
+                gdouble error = bound * (i - k0) * (k1 - i) + 1e-6;
+                gdouble lo = u - error, hi = u + error;
+                guint16 q_lo = lo <= 0.0 ? 0 : lo >= 65535.0 ? 0xffff : (guint16)lo;
+                guint16 q_hi = hi <= 0.0 ? 0 : hi >= 65535.0 ? 0xffff : (guint16)hi;
+                out[i] = q_lo == q_hi ? q_lo : vcgt_quantize(fmin(fmax(vcgt_exact(i, inv_last, scale, exponent), 0.0), 1.0));
+            }
+        }
+        k0 = k1;
+        f0 = f1;
+    }
+    out[last] = vcgt_quantize(fmin(fmax(f0, 0.0), 1.0));
+}
+
+/**
+ * @brief The VCGT kernel: computes the gamma and temperature ramp as 16-bit values.
+ *
+ * Short ramps evaluate every sample, sharing one log2 table between the
+ * channels. From VCGT_KNOT_MIN_SAMPLES entries on, where neighbouring samples
+ * are close enough for interpolation to pay off, the channels are filled from
+ * knots instead. Both give exactly the values lcms2 would write for the
+ * double-precision curve.
+ */
+static void compute_vcgt_ramp(const gfloat gamma[3], const CdColorRGB *temp_color, VcgtRamp *ramp) {
+    const guint n = ramp->n_samples;
+    if (n >= VCGT_KNOT_MIN_SAMPLES) {
+        vcgt_fill_channel_knots(ramp->r, n, temp_color->R, 1.0f / gamma[0]);
+        vcgt_fill_channel_knots(ramp->g, n, temp_color->G, 1.0f / gamma[1]);
+        vcgt_fill_channel_knots(ramp->b, n, temp_color->B, 1.0f / gamma[2]);
+        return;
+    }
+    const gdouble inv_last = 1.0 / (n - 1);
+    gdouble log_x[VCGT_KNOT_MIN_SAMPLES];
+    for (guint i = 0; i < n; i++) {
+        log_x[i] = log2(i * inv_last); // log2(0) = -inf, which exp2() maps back to 0
+    }
+    vcgt_fill_channel(ramp->r, log_x, n, temp_color->R, 1.0f / gamma[0]);
+    vcgt_fill_channel(ramp->g, log_x, n, temp_color->G, 1.0f / gamma[1]);
+    vcgt_fill_channel(ramp->b, log_x, n, temp_color->B, 1.0f / gamma[2]);
+}
+
+/**
+ * @brief Hands a ramp to colord, which wants a GPtrArray of CdColorRGB pointers.
+ *
+ * The entries live in one temporary array and the GPtrArray only borrows them;
+ * colord copies the values into its own tone curves. It truncates R * 0xffff
+ * to 16 bits, so each value is passed as the middle of its step, (v + 0.5) / 65535,
+ * which truncates back to exactly v. The profile then holds the same values
+ * vcgt_quantize() computed, as the large-table writer's profiles do.
+ */
+static gboolean set_vcgt_from_ramp(CdIcc *profile_data, const VcgtRamp *ramp, GError **error) {
+    const guint n = ramp->n_samples;
+    CdColorRGB *colors = g_new(CdColorRGB, n);
+    GPtrArray *vcgt_array = g_ptr_array_sized_new(n);
+    for (guint i = 0; i < n; i++) {
+        colors[i].R = vcgt_unquantize(ramp->r[i]);
+        colors[i].G = vcgt_unquantize(ramp->g[i]);
+        colors[i].B = vcgt_unquantize(ramp->b[i]);
+        g_ptr_array_add(vcgt_array, &colors[i]);
+    }
+    gboolean ret = cd_icc_set_vcgt(profile_data, vcgt_array, error);
+    g_ptr_array_free(vcgt_array, TRUE);
+    g_free(colors);
+    return ret;
+}
+
+/**
+ * @brief Computes the gamma and temperature ramp, without touching any profile.
+ */
+static VcgtRamp *vcgt_compute(const gfloat gamma[3], gint color_temperature, guint n_samples) {
+    CdColorRGB temp_color;
+    blackbody_lookup(color_temperature, &temp_color);
+    VcgtRamp *ramp = vcgt_ramp_new(n_samples);
+    compute_vcgt_ramp(gamma, &temp_color, ramp);
+    return ramp;
+}
+
+/**
+ * @brief Generates a Video Card Gamma Table (VCGT) and applies it to an ICC profile.
+ * @return The ramp, which serialize_profile() needs to write tables larger than 256 entries.
+ */
+static VcgtRamp *generate_vcgt(const gfloat gamma[3], gint color_temperature, guint n_samples, CdIcc *profile_data) {
+    GError *error = NULL;
+    VcgtRamp *ramp = vcgt_compute(gamma, color_temperature, n_samples);
+    if (!set_vcgt_from_ramp(profile_data, ramp, &error)) {
+        g_warning("Failed to set VCGT: %s", error->message);
+        g_error_free(error);
+    }
+    return ramp;
+}
+
+/**
+ * @brief Returns blackbody table entry `index`, computing it on first use.
+ *
+ * Each entry is filled under its own g_once, so library threads calling
+ * gamma_tool_compute_ramp() at once neither race on it nor wait for the
+ * whole table.
+ */
+static const CdColorRGB *blackbody_entry(guint index) {
+    static CdColorRGB table[BLACKBODY_ENTRIES];
+    static gsize filled[BLACKBODY_ENTRIES];
+    if (g_once_init_enter(&filled[index])) {
+        cd_color_get_blackbody_rgb_full(BLACKBODY_MIN + index * BLACKBODY_STEP, &table[index],
+                                        CD_COLOR_BLACKBODY_FLAG_USE_PLANCKIAN);
+        g_once_init_leave(&filled[index], 1);
+    }
+    return &table[index];
+}
+
+/**
+ * @brief Looks up the Planckian whitepoint RGB for a color temperature.
+ *
+ * Backed by a table sampled every 10 K over colord's 1000-25000 K range and
+ * filled lazily, so a one-shot run evaluates at most two entries and repeated
+ * lookups (temperature ramps) never call into colord again. Sample points
+ * return colord's values exactly; between them the result is interpolated
+ * linearly, as colord does between its own coarser samples. Temperatures
+ * outside the table are passed straight to colord.
+ */
+static void blackbody_lookup(gdouble temperature, CdColorRGB *result) {
+    if (temperature < BLACKBODY_MIN || temperature > BLACKBODY_MAX) {
+        cd_color_get_blackbody_rgb_full(temperature, result, CD_COLOR_BLACKBODY_FLAG_USE_PLANCKIAN);
+        return;
+    }
+    gdouble position = (temperature - BLACKBODY_MIN) / BLACKBODY_STEP;
+    guint index = (guint)position;
+    gdouble alpha = position - index;
+    const CdColorRGB *lo = blackbody_entry(index);
+    if (alpha == 0.0) {
+        *result = *lo;
+        return;
+    }
+    const CdColorRGB *hi = blackbody_entry(index + 1);
+    result->R = lo->R + (hi->R - lo->R) * alpha;
+    result->G = lo->G + (hi->G - lo->G) * alpha;
+    result->B = lo->B + (hi->B - lo->B) * alpha;
+}
+
+static guint32 icc_read_u32(const guint8 *p) {
+    return ((guint32)p[0] << 24) | ((guint32)p[1] << 16) | ((guint32)p[2] << 8) | p[3];
+}
+
+static void icc_write_u32(guint8 *p, guint32 value) {
+    p[0] = value >> 24; p[1] = value >> 16; p[2] = value >> 8; p[3] = value;
+}
+
+static void icc_write_u16(guint8 *p, guint16 value) {
+    p[0] = value >> 8; p[1] = value;
+}
+
+/**
+ * @brief Writes a ramp as vcgt table entries: all of red, then green, then blue.
+ */
+static void icc_write_vcgt_entries(guint8 *p, const VcgtRamp *ramp) {
+    for (guint i = 0; i < 3 * ramp->n_samples; i++, p += 2) {
+        icc_write_u16(p, ramp->data[i]);
+    }
+}
+
+/**
+ * @brief Re-encodes the vcgt tag of a serialized profile with ramp->n_samples entries.
+ *
+ * lcms2 always writes vcgt as a 256-entry table whatever the curve size, so
+ * other resolutions are written here. The new tag replaces the old data when
+ * that was the last tag in the file and is appended otherwise.
+ */
+static GBytes *icc_replace_vcgt(GBytes *icc, const VcgtRamp *ramp, GError **error) {
+    gsize len;
+    const guint8 *src = g_bytes_get_data(icc, &len);
+    if (len < ICC_HEADER_SIZE + 4) {
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "ICC data is truncated");
+        return NULL;
+    }
+    guint32 n_tags = icc_read_u32(src + ICC_HEADER_SIZE);
+    if (ICC_HEADER_SIZE + 4 + (gsize)n_tags * ICC_TAG_ENTRY_SIZE > len) {
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "ICC tag table is truncated");
+        return NULL;
+    }
+
+    gsize entry = 0;
+    guint32 old_offset = 0, old_size = 0, last_offset = 0;
+    for (guint32 i = 0; i < n_tags; i++) {
+        const guint8 *e = src + ICC_HEADER_SIZE + 4 + i * ICC_TAG_ENTRY_SIZE;
+        guint32 offset = icc_read_u32(e + 4);
+        if (icc_read_u32(e) == ICC_SIG_VCGT) {
+            entry = e - src;
+            old_offset = offset;
+            old_size = icc_read_u32(e + 8);
+        } else {
+            last_offset = MAX(last_offset, offset);
+        }
+    }
+    if (entry == 0) {
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "ICC data has no vcgt tag");
+        return NULL;
+    }
+
+    // Reuse the old slot if nothing follows it, otherwise append (4-byte aligned).
+    gsize keep = len;
+    if (old_offset > last_offset && ((gsize)old_offset + old_size + 3) / 4 * 4 >= len) {
+        keep = old_offset;
+    }
+    gsize tag_offset = (keep + 3) / 4 * 4;
+    gsize tag_size = 18 + 3 * 2 * (gsize)ramp->n_samples;
+    gsize total = (tag_offset + tag_size + 3) / 4 * 4;
+
+    guint8 *dst = g_malloc0(total);
+    memcpy(dst, src, keep);
+    guint8 *tag = dst + tag_offset;
+    icc_write_u32(tag, ICC_SIG_VCGT);
+    icc_write_u32(tag + 4, 0);  // Reserved
+    icc_write_u32(tag + 8, 0);  // Table, not formula
+    icc_write_u16(tag + 12, 3); // Channels
+    icc_write_u16(tag + 14, ramp->n_samples);
+    icc_write_u16(tag + 16, 2); // Bytes per entry
+    icc_write_vcgt_entries(tag + 18, ramp);
+
+    icc_write_u32(dst + entry + 4, tag_offset);
+    icc_write_u32(dst + entry + 8, tag_size);
+    icc_write_u32(dst, total);  // Profile size
+    memset(dst + 84, 0, 16);    // Profile ID no longer matches; zero means "not computed"
+    return g_bytes_new_take(dst, total);
+}
+
+static void set_error_from_errno(GError **error, int saved_errno, const gchar *path) {
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno), "%s: %s", path, g_strerror(saved_errno));
+}
+
+/**
+ * @brief Writes all of buf to fd, retrying short writes.
+ */
+static gboolean write_all(int fd, const gchar *buf, gsize len, const gchar *path, GError **error) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            set_error_from_errno(error, errno, path);
+            return FALSE;
+        }
+        buf += written;
+        len -= written;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Overwrites a file's contents without replacing the inode.
+ *
+ * write_atomic() puts a new inode in place, which colord sees as a new profile
+ * appearing. Truncating and writing only produces change events, which colord
+ * ignores, so a slot keeps its colord object.
+ */
+static gboolean write_in_place(const gchar *path, const gchar *buf, gsize len, GError **error) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        set_error_from_errno(error, errno, path);
+        return FALSE;
+    }
+    gboolean ok = write_all(fd, buf, len, path, error);
+    if (close(fd) != 0 && ok) {
+        set_error_from_errno(error, errno, path);
+        ok = FALSE;
+    }
+    return ok;
+}
+
+/**
+ * @brief Writes a temporary file next to path and renames it into place.
+ */
+static gboolean write_via_rename(const gchar *path, const gchar *buf, gsize len, GError **error) {
+    gchar *dir = g_path_get_dirname(path);
+    gchar *basename = g_path_get_basename(path);
+    // Hidden and without the .icc suffix, so colord doesn't try to load it.
+    gchar *tmp_path = g_strdup_printf("%s/.%s.XXXXXX", dir, basename);
+    g_free(dir);
+    g_free(basename);
+    int fd = g_mkstemp_full(tmp_path, O_WRONLY, 0644);
+    if (fd < 0) {
+        set_error_from_errno(error, errno, tmp_path);
+        g_free(tmp_path);
+        return FALSE;
+    }
+    gboolean ok = write_all(fd, buf, len, tmp_path, error);
+    if (close(fd) != 0 && ok) {
+        set_error_from_errno(error, errno, tmp_path);
+        ok = FALSE;
+    }
+    if (ok && rename(tmp_path, path) != 0) {
+        set_error_from_errno(error, errno, path);
+        ok = FALSE;
+    }
+    if (!ok) unlink(tmp_path);
+    g_free(tmp_path);
+    return ok;
+}
+
+/**
+ * @brief Writes a file so that it only ever appears complete, with one create event.
+ *
+ * Where the kernel and filesystem support O_TMPFILE, the data goes into an
+ * unnamed inode in the target directory, which linkat() then gives its name,
+ * so colord's directory watcher never sees a partial or temporary file.
+ * Otherwise, or if path already exists (linkat() can't replace), a temporary
+ * file is renamed into place.
+ */
+static gboolean write_atomic(const gchar *path, const gchar *buf, gsize len, GError **error) {
+#ifdef O_TMPFILE
+    gchar *dir = g_path_get_dirname(path);
+    int fd = open(dir, O_TMPFILE | O_WRONLY, 0644);
+    g_free(dir);
+    if (fd >= 0) {
+        if (!write_all(fd, buf, len, path, error)) {
+            close(fd);
+            return FALSE;
+        }
+        gchar proc_path[64];
+        g_snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+        int linked = linkat(AT_FDCWD, proc_path, AT_FDCWD, path, AT_SYMLINK_FOLLOW);
+        int saved_errno = errno;
+        close(fd);
+        if (linked == 0) {
+            return TRUE;
+        }
+        if (saved_errno != EEXIST) {
+            g_debug("linkat() failed for %s: %s", path, g_strerror(saved_errno));
+        }
+    }
+#endif
+    return write_via_rename(path, buf, len, error);
+}
+
+/**
+ * @brief Serializes a profile, keeping the ramp's native size.
+ * @return The ICC data, or NULL with error set.
+ */
+static GBytes *serialize_profile(CdIcc *profile_data, const VcgtRamp *ramp, GError **error) {
+    GBytes *data = cd_icc_save_data(profile_data, CD_ICC_SAVE_FLAGS_NONE, error);
+    if (data && ramp->n_samples != 256) {
+        GBytes *patched = icc_replace_vcgt(data, ramp, error);
+        g_bytes_unref(data);
+        data = patched;
+    }
+    return data;
+}
+
+/**
+ * @brief Writes serialized profile data to path.
+ * @param in_place Overwrite the existing file rather than replacing it.
+ */
+static gboolean write_profile(GBytes *data, const gchar *path, gboolean in_place, GError **error) {
+    gsize len;
+    const gchar *buf = g_bytes_get_data(data, &len);
+    return in_place ? write_in_place(path, buf, len, error) : write_atomic(path, buf, len, error);
+}
+
+static const guint template_field_width[TEMPLATE_N_FIELDS] = {
+    [TEMPLATE_DESCRIPTION] = 48,
+    [TEMPLATE_UUID] = 64,         // A SHA-256 cache key
+    [TEMPLATE_GAMMA] = 48,        // Three "%.9g" values
+    [TEMPLATE_TEMPERATURE] = 12,
+};
+
+/**
+ * @brief Returns a placeholder for a field: a unique marker padded to the field's width.
+ */
+static gchar *template_placeholder(TemplateField field) {
+    gchar *placeholder = g_strnfill(template_field_width[field], '~');
+    memcpy(placeholder, "@GT", 3);
+    placeholder[3] = 'A' + field;
+    return placeholder;
+}
+
+/**
+ * @brief Records every ASCII and UTF-16BE occurrence of a placeholder in data.
+ */
+static void template_find_slots(GArray *slots, const guint8 *data, gsize len, const gchar *placeholder) {
+    gsize width = strlen(placeholder);
+    guint8 *wide = g_malloc0(2 * width);
+    for (gsize k = 0; k < width; k++) {
+        wide[2 * k + 1] = placeholder[k];
+    }
+    for (int utf16 = 0; utf16 <= 1; utf16++) {
+        const guint8 *pattern = utf16 ? wide : (const guint8 *)placeholder;
+        gsize pattern_len = utf16 ? 2 * width : width;
+        for (gsize offset = 0; offset + pattern_len <= len; offset++) {
+            if (memcmp(data + offset, pattern, pattern_len) == 0) {
+                TemplateSlot slot = { offset, utf16 };
+                g_array_append_val(slots, slot);
+                offset += pattern_len - 1;
+            }
+        }
+    }
+    g_free(wide);
+}
+
+/**
+ * @brief Serializes a base profile into a template for profiles of n_samples entries.
+ *
+ * The vcgt tag is always written by icc_replace_vcgt() so its layout is known,
+ * and the per-profile strings are placeholders of fixed width, so every profile
+ * derived from the template has the same size and tag layout. Modifies the
+ * metadata and vcgt of profile_data.
+ *
+ * @return The template, or NULL if a placeholder could not be located.
+ */
+static IccTemplate *icc_template_new(CdIcc *profile_data, guint n_samples, const char *base, const char *base_checksum, GError **error) {
+    gchar *placeholders[TEMPLATE_N_FIELDS];
+    for (int f = 0; f < TEMPLATE_N_FIELDS; f++) {
+        placeholders[f] = template_placeholder(f);
+    }
+    cd_icc_set_description(profile_data, "", placeholders[TEMPLATE_DESCRIPTION]);
+    cd_icc_add_metadata(profile_data, "uuid", placeholders[TEMPLATE_UUID]);
+    if (base) cd_icc_add_metadata(profile_data, "GAMMA_TOOL_base", base);
+    cd_icc_add_metadata(profile_data, "GAMMA_TOOL_gamma", placeholders[TEMPLATE_GAMMA]);
+    cd_icc_add_metadata(profile_data, "GAMMA_TOOL_temperature", placeholders[TEMPLATE_TEMPERATURE]);
+    gchar *samples = g_strdup_printf("%u", n_samples);
+    cd_icc_add_metadata(profile_data, "GAMMA_TOOL_samples", samples);
+    g_free(samples);
+    if (!base_checksum) base_checksum = cd_icc_get_checksum(profile_data);
+    if (base_checksum) cd_icc_add_metadata(profile_data, "GAMMA_TOOL_base_checksum", base_checksum);
+
+    const gfloat neutral[3] = {1.0f, 1.0f, 1.0f};
+    VcgtRamp *ramp = vcgt_compute(neutral, 6500, n_samples);
+    GBytes *data = NULL;
+    if (set_vcgt_from_ramp(profile_data, ramp, error)) {
+        GBytes *raw = cd_icc_save_data(profile_data, CD_ICC_SAVE_FLAGS_NONE, error);
+        if (raw) {
+            data = icc_replace_vcgt(raw, ramp, error);
+            g_bytes_unref(raw);
+        }
+    }
+    g_free(ramp);
+
+    IccTemplate *template = NULL;
+    if (data) {
+        template = g_new0(IccTemplate, 1);
+        template->data = data;
+        template->n_samples = n_samples;
+        gsize len;
+        const guint8 *p = g_bytes_get_data(data, &len);
+        guint32 n_tags = icc_read_u32(p + ICC_HEADER_SIZE);
+        for (guint32 i = 0; i < n_tags; i++) {
+            const guint8 *e = p + ICC_HEADER_SIZE + 4 + i * ICC_TAG_ENTRY_SIZE;
+            if (icc_read_u32(e) == ICC_SIG_VCGT) {
+                template->vcgt_data = icc_read_u32(e + 4) + 18;
+            }
+        }
+        gboolean found = TRUE;
+        for (int f = 0; f < TEMPLATE_N_FIELDS; f++) {
+            template->slots[f] = g_array_new(FALSE, FALSE, sizeof(TemplateSlot));
+            template_find_slots(template->slots[f], p, len, placeholders[f]);
+            found = found && template->slots[f]->len > 0;
+        }
+        if (!found) {
+            g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Template placeholders not found in serialized profile");
+            icc_template_free(template);
+            template = NULL;
+        }
+    }
+    for (int f = 0; f < TEMPLATE_N_FIELDS; f++) {
+        g_free(placeholders[f]);
+    }
+    return template;
+}
+
+/**
+ * @brief Produces a profile from a template by patching in the settings and the ramp.
+ *
+ * Values are padded with NULs to their field's width. Readers stop at the
+ * first one, so unlike space padding this doesn't show up as trailing
+ * blanks in the description colord and GNOME Settings display.
+ * @return The ICC data, or NULL if a value is too long for its field.
+ */
+static GBytes *icc_template_render(const IccTemplate *template, const gfloat gamma[3], gint temperature,
+                                   const char *uuid, const VcgtRamp *ramp) {
+    if (ramp->n_samples != template->n_samples) {
+        return NULL;
+    }
+    gchar *values[TEMPLATE_N_FIELDS] = {
+        [TEMPLATE_DESCRIPTION] = g_strdup_printf("gamma-tool: g=%.2f:%.2f:%.2f t=%d", gamma[0], gamma[1], gamma[2], temperature),
+        [TEMPLATE_UUID] = g_strdup(uuid),
+        [TEMPLATE_GAMMA] = g_strdup_printf("%.9g:%.9g:%.9g", gamma[0], gamma[1], gamma[2]),
+        [TEMPLATE_TEMPERATURE] = g_strdup_printf("%d", temperature),
+    };
+    gboolean fits = TRUE;
+    for (int f = 0; f < TEMPLATE_N_FIELDS; f++) {
+        fits = fits && strlen(values[f]) <= template_field_width[f];
+    }
+
+    GBytes *result = NULL;
+    if (fits) {
+        gsize len;
+        const guint8 *src = g_bytes_get_data(template->data, &len);
+        guint8 *dst = g_malloc(len);
+        memcpy(dst, src, len);
+        for (int f = 0; f < TEMPLATE_N_FIELDS; f++) {
+            gsize value_len = strlen(values[f]);
+            for (guint s = 0; s < template->slots[f]->len; s++) {
+                const TemplateSlot *slot = &g_array_index(template->slots[f], TemplateSlot, s);
+                for (guint k = 0; k < template_field_width[f]; k++) {
+                    gchar c = k < value_len ? values[f][k] : '\0';
+                    if (slot->utf16) {
+                        dst[slot->offset + 2 * k] = 0;
+                        dst[slot->offset + 2 * k + 1] = c;
+                    } else {
+                        dst[slot->offset + k] = c;
+                    }
+                }
+            }
+        }
+        icc_write_vcgt_entries(dst + template->vcgt_data, ramp);
+        result = g_bytes_new_take(dst, len);
+    }
+    for (int f = 0; f < TEMPLATE_N_FIELDS; f++) {
+        g_free(values[f]);
+    }
+    return result;
+}
+
+static void icc_template_free(IccTemplate *template) {
+    g_bytes_unref(template->data);
+    for (int f = 0; f < TEMPLATE_N_FIELDS; f++) {
+        if (template->slots[f]) g_array_free(template->slots[f], TRUE);
+    }
+    g_free(template);
+}
+
+/**
+ * @brief Builds the SetCrtcGamma parameters from a quantized ramp of crtc->gamma_size entries.
+ */
+static GVariant *crtc_gamma_params(const CrtcInfo *crtc, const guint16 *values) {
+    guint n = crtc->gamma_size;
+    return g_variant_new("(uu@aq@aq@aq)", crtc->serial, crtc->crtc,
+                         g_variant_new_fixed_array(G_VARIANT_TYPE_UINT16, values, n, sizeof(guint16)),
+                         g_variant_new_fixed_array(G_VARIANT_TYPE_UINT16, values + n, n, sizeof(guint16)),
+                         g_variant_new_fixed_array(G_VARIANT_TYPE_UINT16, values + 2 * n, n, sizeof(guint16)));
+}
+
+static void on_crtc_gamma_set(GObject *source, GAsyncResult *res, gpointer user_data) {
+    DeviceJob *job = user_data;
+    GError *error = NULL;
+    GVariant *reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+    if (reply) {
+        g_variant_unref(reply);
+        job_printf(job, "Gamma ramp set directly%s\n", job->args.no_persist ? " (not saved)" : "");
+        session_remember_direct(job->run->session, job->device, &job->args);
+    } else {
+        job_error(job, "Could not set CRTC gamma: %s", error->message);
+        g_error_free(error);
+        // Most likely the serial is stale; look the CRTCs up again next time.
+        g_clear_pointer(&job->run->session->crtcs, g_hash_table_unref);
+    }
+    job_phase(job, "set-crtc-gamma");
+    job_finish(job);
+}
+
+/**
+ * @brief Handles --direct: pushes the ramp straight to the device's CRTC through Mutter.
+ *
+ * Nothing is written and colord isn't involved, so the change shows up as soon
+ * as Mutter applies it. It lasts until the next colord profile change; the
+ * daemon schedules that commit itself (see daemon_schedule_commit()).
+ */
+static void handle_direct_mode(DeviceJob *job) {
+    AppArgs *args = &job->args;
+    const CrtcInfo *crtc = job_get_crtc(job);
+    if (!crtc || crtc->gamma_size < 2) {
+        job_error(job, "No CRTC for this display; can't set gamma directly.");
+        job_finish(job);
+        return;
+    }
+    // The CRTC came from session_get_crtcs(), so the session bus is connected.
+    GDBusConnection *bus = job->run->session->bus;
+    VcgtRamp *ramp = vcgt_compute(args->gamma, args->temperature, crtc->gamma_size);
+    GVariant *params = crtc_gamma_params(crtc, ramp->data);
+    g_free(ramp);
+    job_phase(job, "generate-vcgt");
+    g_dbus_connection_call(bus, MUTTER_DISPLAY_CONFIG_BUS, MUTTER_DISPLAY_CONFIG_PATH, MUTTER_DISPLAY_CONFIG_BUS,
+                           "SetCrtcGamma", params, NULL, G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, NULL,
+                           on_crtc_gamma_set, job);
+}
+
+/**
+ * @brief Asks Mutter for the CRTC and gamma ramp size of every lit output.
+ * @return A table of connector name -> CrtcInfo, or NULL if Mutter's
+ *         DisplayConfig interface isn't available.
+ */
+static GHashTable *query_crtcs(GDBusConnection *bus) {
+    GError *error = NULL;
+    GVariant *resources = g_dbus_connection_call_sync(bus, MUTTER_DISPLAY_CONFIG_BUS, MUTTER_DISPLAY_CONFIG_PATH,
+                                                      MUTTER_DISPLAY_CONFIG_BUS, "GetResources", NULL,
+                                                      G_VARIANT_TYPE("(ua(uxiiiiiiuaua{sv})a(uxiausauaua{sv})a(uxuudu)ii)"),
+                                                      G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, NULL, &error);
+    if (!resources) {
+        g_warning("Could not query Mutter's CRTCs: %s", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    GHashTable *crtcs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    guint serial;
+    GVariantIter *outputs;
+    g_variant_get(resources, "(u@a(uxiiiiiiuaua{sv})a(uxiausauaua{sv})@a(uxuudu)ii)",
+                  &serial, NULL, &outputs, NULL, NULL, NULL);
+    gint crtc;
+    const gchar *name;
+    while (g_variant_iter_loop(outputs, "(uxi@au&s@au@au@a{sv})", NULL, NULL, &crtc, NULL, &name, NULL, NULL, NULL)) {
+        if (crtc < 0) {
+            continue; // Output is not lit
+        }
+        GVariant *gamma = g_dbus_connection_call_sync(bus, MUTTER_DISPLAY_CONFIG_BUS, MUTTER_DISPLAY_CONFIG_PATH,
+                                                      MUTTER_DISPLAY_CONFIG_BUS, "GetCrtcGamma",
+                                                      g_variant_new("(uu)", serial, (guint)crtc),
+                                                      G_VARIANT_TYPE("(aqaqaq)"),
+                                                      G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, NULL, &error);
+        if (!gamma) {
+            g_warning("Could not get gamma size for %s: %s", name, error->message);
+            g_clear_error(&error);
+            continue;
+        }
+        GVariant *red = g_variant_get_child_value(gamma, 0);
+        CrtcInfo *info = g_new(CrtcInfo, 1);
+        info->serial = serial;
+        info->crtc = crtc;
+        info->gamma_size = g_variant_n_children(red);
+        g_hash_table_insert(crtcs, g_strdup(name), info);
+        g_variant_unref(red);
+        g_variant_unref(gamma);
+    }
+    g_variant_iter_free(outputs);
+    g_variant_unref(resources);
+    return crtcs;
+}
+
+static void on_monitors_changed(GDBusConnection *connection, const gchar *sender, const gchar *object_path,
+                                const gchar *interface_name, const gchar *signal_name, GVariant *parameters,
+                                gpointer user_data) {
+    Session *session = user_data;
+    g_clear_pointer(&session->crtcs, g_hash_table_unref);
+}
+
+/**
+ * @brief Returns the session's CRTC table, asking Mutter only if it is stale.
+ *
+ * Querying costs a GetResources call plus a full GetCrtcGamma per lit CRTC,
+ * so the table is kept until Mutter reports a monitor change.
+ * @return A new reference to the table, or NULL if Mutter isn't available.
+ */
+static GHashTable *session_get_crtcs(Session *session) {
+    if (!session->bus) {
+        GError *error = NULL;
+        session->bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+        if (!session->bus) {
+            g_warning("Could not connect to the session bus: %s", error->message);
+            g_error_free(error);
+            return NULL;
+        }
+        // Subscribed before the first query, so a change during it isn't missed.
+        session->monitors_changed_id = g_dbus_connection_signal_subscribe(
+            session->bus, MUTTER_DISPLAY_CONFIG_BUS, MUTTER_DISPLAY_CONFIG_BUS, "MonitorsChanged",
+            MUTTER_DISPLAY_CONFIG_PATH, NULL, G_DBUS_SIGNAL_FLAGS_NONE, on_monitors_changed, session, NULL);
+    }
+    if (!session->crtcs) {
+        session->crtcs = query_crtcs(session->bus);
+    }
+    return session->crtcs ? g_hash_table_ref(session->crtcs) : NULL;
+}
+
+static void on_sRGB_profile_default(GObject *source, GAsyncResult *res, gpointer user_data) {
+    DeviceJob *job = user_data;
+    GError *error = NULL;
+    if (!cd_device_make_profile_default_finish(CD_DEVICE(source), res, &error)) {
+        job_error(job, "Failed to make sRGB profile default: %s", error->message);
+        g_error_free(error);
+        job_finish(job);
+        return;
+    }
+    dispatch_mode(job);
+}
+
+static void on_sRGB_profile_added(GObject *source, GAsyncResult *res, gpointer user_data) {
+    DeviceJob *job = user_data;
+    GError *error = NULL;
+    if (!cd_device_add_profile_finish(CD_DEVICE(source), res, &error)) {
+        job_error(job, "Failed to add sRGB profile: %s", error->message);
+        g_error_free(error);
+        job_finish(job);
+        return;
+    }
+    cd_device_make_profile_default(job->device, job->profile, NULL, on_sRGB_profile_default, job);
+}
+
+static void on_sRGB_profile_connected(GObject *source, GAsyncResult *res, gpointer user_data) {
+    DeviceJob *job = user_data;
+    GError *error = NULL;
+    if (!cd_profile_connect_finish(CD_PROFILE(source), res, &error)) {
+        job_error(job, "Could not connect to sRGB profile: %s", error->message);
+        g_error_free(error);
+        job_finish(job);
+        return;
+    }
+    session_cache_profile(job->run->session, job->profile);
+    cd_device_add_profile(job->device, CD_DEVICE_RELATION_HARD, job->profile, NULL, on_sRGB_profile_added, job);
+}
+
+static void on_sRGB_profile_found(GObject *source, GAsyncResult *res, gpointer user_data) {
+    DeviceJob *job = user_data;
+    GError *error = NULL;
+    job->profile = cd_client_find_profile_by_filename_finish(CD_CLIENT(source), res, &error);
+    if (!job->profile) {
+        job_error(job, "Failed to find sRGB.icc profile: %s", error ? error->message : "Not found");
+        if(error) g_error_free(error);
+        job_finish(job);
+        return;
+    }
+    cd_profile_connect(job->profile, NULL, on_sRGB_profile_connected, job);
+}
+
+/**
+ * @brief Finds the standard sRGB profile and sets it as the default for a device.
+ *
+ * On success the job continues with the sRGB profile as its base profile.
+ */
+static void create_and_set_sRGB_profile(DeviceJob *job) {
+    cd_client_find_profile_by_filename(job->run->session->client, "sRGB.icc", NULL, on_sRGB_profile_found, job);
+}
+
+// --- Transitions: -t START..END --over DURATION ---
+
+static void on_transition_run_done(RunContext *run, gpointer user_data);
+static void transition_schedule(Transition *transition);
+
+/**
+ * @brief Creates a transition; nothing happens until transition_start().
+ *
+ * `report` is called with every profile run as it finishes, `done` once the
+ * end temperature has been applied.
+ */
+static Transition *transition_new(Session *session, const AppArgs *args, RunDoneFunc report,
+                                  TransitionDoneFunc done, gpointer user_data) {
+    Transition *transition = g_new0(Transition, 1);
+    transition->session = session;
+    transition->args = *args;
+    transition->targets = g_ptr_array_new();
+    transition->ramps = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    transition->report = report;
+    transition->done = done;
+    transition->user_data = user_data;
+    return transition;
+}
+
+static void transition_free(Transition *transition) {
+    if (transition->timeout_id) g_source_remove(transition->timeout_id);
+    if (transition->bus) g_object_unref(transition->bus);
+    if (transition->crtcs) g_hash_table_unref(transition->crtcs);
+    g_ptr_array_free(transition->targets, TRUE);
+    g_hash_table_unref(transition->ramps);
+    g_free(transition->temperatures);
+    g_free(transition);
+}
+
+/**
+ * @brief Applies one temperature as a profile, through an ordinary run.
+ */
+static void transition_apply(Transition *transition, gint temperature) {
+    AppArgs args = transition->args;
+    args.temperature = temperature;
+    if (transition->n_frames > 0) {
+        args.temperature_end = 0; // Only the first run needs to look up the CRTCs
+    }
+    transition->run = run_new(transition->session, &args, on_transition_run_done, transition);
+    run_start(transition->run);
+}
+
+/**
+ * @brief Returns the monotonic time at which a frame is due.
+ */
+static gint64 transition_frame_time(Transition *transition, guint frame) {
+    return transition->start_time + transition->duration * frame / (transition->n_frames - 1);
+}
+
+/**
+ * @brief Picks the frame count and temperatures, and a ramp for each CRTC gamma size.
+ *
+ * Frames are spaced evenly in mired (1e6 / K), where equal steps look about
+ * equally large, and are at most TRANSITION_MIRED_STEP apart. That is far
+ * below what a slow fade makes visible, so the frame rate follows from the
+ * temperature range and the duration instead of a fixed timer.
+ */
+static void transition_prepare(Transition *transition, RunContext *first_run) {
+    AppArgs *args = &transition->args;
+    gdouble mired_start = 1e6 / args->temperature;
+    gdouble mired_end = 1e6 / args->temperature_end;
+    transition->duration = (gint64)args->over_seconds * G_USEC_PER_SEC;
+    guint64 max_steps = MAX(transition->duration / (TRANSITION_MIN_FRAME_MS * 1000), 1);
+    guint64 steps = (guint64)ceil(fabs(mired_end - mired_start) / TRANSITION_MIRED_STEP);
+    transition->n_frames = CLAMP(steps, 1, max_steps) + 1;
+    transition->temperatures = g_new(gint, transition->n_frames);
+    for (guint i = 0; i < transition->n_frames; i++) {
+        gdouble mired = mired_start + (mired_end - mired_start) * i / (transition->n_frames - 1);
+        transition->temperatures[i] = (gint)lround(1e6 / mired);
+    }
+
+    // The first run looked up the selected displays and their CRTCs for us.
+    transition->crtcs = g_steal_pointer(&first_run->crtcs);
+    for (guint i = 0; transition->crtcs && i < first_run->jobs->len; i++) {
+        DeviceJob *job = g_ptr_array_index(first_run->jobs, i);
+        const char *connector = cd_device_get_metadata_item(job->device, CD_DEVICE_METADATA_XRANDR_NAME);
+        const CrtcInfo *crtc = connector ? g_hash_table_lookup(transition->crtcs, connector) : NULL;
+        if (crtc && crtc->gamma_size >= 2) {
+            g_ptr_array_add(transition->targets, (gpointer)crtc);
+        }
+    }
+    if (transition->targets->len > 0) {
+        GError *error = NULL;
+        transition->bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+        if (!transition->bus) {
+            g_warning("Could not connect to the session bus: %s", error->message);
+            g_error_free(error);
+            g_ptr_array_set_size(transition->targets, 0);
+        }
+    }
+    for (guint i = 0; i < transition->targets->len; i++) {
+        const CrtcInfo *crtc = g_ptr_array_index(transition->targets, i);
+        guint size = crtc->gamma_size;
+        if (!g_hash_table_contains(transition->ramps, GUINT_TO_POINTER(size))) {
+            g_hash_table_insert(transition->ramps, GUINT_TO_POINTER(size), vcgt_ramp_new(size));
+        }
+    }
+
+    if (transition->targets->len == 0 && args->checkpoint_seconds == 0) {
+        // Without CRTCs to send frames to, checkpoints are the only steps.
+        args->checkpoint_seconds = TRANSITION_FALLBACK_CHECKPOINT;
+        g_string_append_printf(first_run->output, "Can't set gamma directly; saving a profile every %d s instead.\n",
+                               TRANSITION_FALLBACK_CHECKPOINT);
+    }
+    g_string_append_printf(first_run->output, "Transition: %d K to %d K over %u s in %u steps.\n",
+                           args->temperature, args->temperature_end, args->over_seconds, transition->n_frames - 1);
+
+    transition->start_time = g_get_monotonic_time();
+    if (args->checkpoint_seconds) {
+        transition->next_checkpoint = transition->start_time + (gint64)args->checkpoint_seconds * G_USEC_PER_SEC;
+    }
+}
+
+static void on_transition_frame_set(GObject *source, GAsyncResult *res, gpointer user_data) {
+    GError *error = NULL;
+    GVariant *reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+    if (reply) {
+        g_variant_unref(reply);
+    } else {
+        g_warning("Could not set CRTC gamma: %s", error->message);
+        g_error_free(error);
+    }
+}
+
+/**
+ * @brief Computes a frame once per gamma size and sends it to every target CRTC.
+ *
+ * Only one ramp per size is kept, so a long fade over many frames costs no
+ * more memory than a single step; a frame takes a fraction of a millisecond.
+ */
+static void transition_show_frame(Transition *transition, guint frame) {
+    CdColorRGB temp_color;
+    blackbody_lookup(transition->temperatures[frame], &temp_color);
+    GHashTableIter iter;
+    gpointer ramp;
+    g_hash_table_iter_init(&iter, transition->ramps);
+    while (g_hash_table_iter_next(&iter, NULL, &ramp)) {
+        compute_vcgt_ramp(transition->args.gamma, &temp_color, ramp);
+    }
+    for (guint i = 0; i < transition->targets->len; i++) {
+        const CrtcInfo *crtc = g_ptr_array_index(transition->targets, i);
+        const VcgtRamp *sized = g_hash_table_lookup(transition->ramps, GUINT_TO_POINTER(crtc->gamma_size));
+        g_dbus_connection_call(transition->bus, MUTTER_DISPLAY_CONFIG_BUS, MUTTER_DISPLAY_CONFIG_PATH,
+                               MUTTER_DISPLAY_CONFIG_BUS, "SetCrtcGamma",
+                               crtc_gamma_params(crtc, sized->data), NULL,
+                               G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, NULL, on_transition_frame_set, NULL);
+    }
+}
+
+static gboolean on_transition_tick(gpointer user_data) {
+    Transition *transition = user_data;
+    transition->timeout_id = 0;
+    gint64 now = g_get_monotonic_time();
+    guint last = transition->n_frames - 1;
+    // Work from the clock rather than counting ticks, so late or coalesced
+    // wakeups just skip ahead.
+    guint frame = now - transition->start_time >= transition->duration ? last :
+                  (guint)((now - transition->start_time) * last / transition->duration);
+    if (frame > transition->frame) {
+        transition->frame = frame;
+        transition_show_frame(transition, frame);
+    }
+    if (frame == last) {
+        transition_apply(transition, transition->args.temperature_end);
+    } else if (transition->next_checkpoint && now >= transition->next_checkpoint) {
+        transition->next_checkpoint += (gint64)transition->args.checkpoint_seconds * G_USEC_PER_SEC;
+        transition_apply(transition, transition->temperatures[frame]);
+    } else {
+        transition_schedule(transition);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Sleeps until the next frame or checkpoint is due.
+ *
+ * Waits of a second or more use g_timeout_add_seconds(), which GLib lines up
+ * with other once-a-second wakeups, so a slow fade barely wakes the CPU.
+ */
+static void transition_schedule(Transition *transition) {
+    guint last = transition->n_frames - 1;
+    gint64 next = transition_frame_time(transition, transition->targets->len > 0 ? transition->frame + 1 : last);
+    if (transition->next_checkpoint && transition->next_checkpoint < next) {
+        next = transition->next_checkpoint;
+    }
+    gint64 delay_ms = MAX(next - g_get_monotonic_time(), 0) / 1000;
+    if (delay_ms >= 1000) {
+        transition->timeout_id = g_timeout_add_seconds(delay_ms / 1000, on_transition_tick, transition);
+    } else {
+        transition->timeout_id = g_timeout_add(delay_ms, on_transition_tick, transition);
+    }
+}
+
+static void on_transition_run_done(RunContext *run, gpointer user_data) {
+    Transition *transition = user_data;
+    transition->run = NULL;
+    if (run->status != 0) {
+        transition->status = run->status;
+    }
+    gboolean first = transition->n_frames == 0;
+    if (first && run->jobs->len > 0) {
+        transition_prepare(transition, run);
+    }
+    transition->report(run, transition->user_data);
+    g_idle_add(run_free_idle, run);
+
+    if (transition->n_frames == 0 || transition->frame == transition->n_frames - 1) {
+        // Finished, or no display to fade.
+        transition->finished = TRUE;
+        transition->done(transition, transition->user_data);
+    } else {
+        // Frames were held while the profile was being applied.
+        transition_schedule(transition);
+    }
+}
+
+/**
+ * @brief Applies the start temperature as a profile, then starts the fade.
+ */
+static void transition_start(Transition *transition) {
+    transition_apply(transition, transition->args.temperature);
+}
+
+// --- Offline generation: --generate and --generate-batch ---
+
+/**
+ * @brief Loads a base profile for offline generation, reusing earlier loads.
+ *
+ * Like session_get_base_icc(), the cached CdIcc is mutated by every profile
+ * derived from it; each one overwrites the same vcgt and metadata.
+ */
+static CdIcc *generate_get_base_icc(GHashTable *bases, const char *filename, GError **error) {
+    CdIcc *icc = g_hash_table_lookup(bases, filename);
+    if (icc) {
+        return icc;
+    }
+    GFile *file = g_file_new_for_path(filename);
+    icc = cd_icc_new();
+    gboolean ok = cd_icc_load_file(icc, file, CD_ICC_LOAD_FLAGS_NONE, NULL, error);
+    g_object_unref(file);
+    if (!ok) {
+        g_object_unref(icc);
+        return NULL;
+    }
+    g_hash_table_insert(bases, g_strdup(filename), icc);
+    return icc;
+}
+
+/**
+ * @brief Builds one profile from args->generate_base and writes it to args->output_path.
+ *
+ * Produces the same bytes apply mode would, minus anything that needs colord.
+ */
+static gboolean generate_one(GHashTable *bases, GHashTable *templates, const AppArgs *args, GError **error) {
+    if (args->auto_samples) {
+        g_set_error_literal(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "-n auto needs a display; give a size.");
+        return FALSE;
+    }
+    CdIcc *profile_data = generate_get_base_icc(bases, args->generate_base, error);
+    if (!profile_data) {
+        return FALSE;
+    }
+    gchar *base_checksum = g_strdup(cd_icc_get_checksum(profile_data));
+    gchar *key = profile_cache_key(base_checksum, args->gamma, args->temperature, args->n_samples);
+
+    gchar *template_key = g_strdup_printf("%s|%u", args->generate_base, args->n_samples);
+    IccTemplate *template = g_hash_table_lookup(templates, template_key);
+    if (!template) {
+        template = icc_template_new(profile_data, args->n_samples, args->generate_base, base_checksum, NULL);
+        if (template) {
+            g_hash_table_insert(templates, template_key, template);
+            template_key = NULL;
+        }
+    }
+    g_free(template_key);
+
+    VcgtRamp *ramp = vcgt_compute(args->gamma, args->temperature, args->n_samples);
+    GBytes *data = template ? icc_template_render(template, args->gamma, args->temperature, key, ramp) : NULL;
+    if (!data) {
+        set_profile_metadata(profile_data, args, args->n_samples, args->generate_base, base_checksum, key);
+        if (set_vcgt_from_ramp(profile_data, ramp, error)) {
+            data = serialize_profile(profile_data, ramp, error);
+        }
+    }
+    g_free(ramp);
+    g_free(key);
+    g_free(base_checksum);
+    if (!data) {
+        return FALSE;
+    }
+
+    gsize len;
+    const gchar *buf = g_bytes_get_data(data, &len);
+    gboolean ok;
+    if (g_strcmp0(args->output_path, "-") == 0) {
+        ok = fwrite(buf, 1, len, stdout) == len;
+        if (!ok) {
+            g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Could not write to stdout");
+        }
+    } else {
+        ok = write_atomic(args->output_path, buf, len, error);
+    }
+    g_bytes_unref(data);
+    return ok;
+}
+
+typedef gboolean (*BatchLineFunc)(AppArgs *line_args, guint line_number, gpointer user_data, GError **error);
+
+/**
+ * @brief Parses each line of FILE (or stdin for "-") as a command line and hands it to func.
+ *
+ * Blank lines and lines starting with '#' are skipped. A line that doesn't
+ * parse, or that func fails, is reported with its line number and clears *ok;
+ * the rest still run. The parsed arguments point into the line, so func has
+ * to copy whatever it keeps beyond the call.
+ * @return FALSE if the input couldn't be opened.
+ */
+static gboolean batch_foreach_line(const char *path, BatchLineFunc func, gpointer user_data, gboolean *ok) {
+    FILE *input = g_strcmp0(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!input) {
+        fprintf(stderr, "Error: Could not open %s: %s\n", path, g_strerror(errno));
+        return FALSE;
+    }
+    char *line = NULL;
+    size_t line_size = 0;
+    guint line_number = 0;
+    while (getline(&line, &line_size, input) >= 0) {
+        line_number++;
+        g_strstrip(line);
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        GError *error = NULL;
+        gint line_argc;
+        gchar **line_argv = NULL;
+        if (g_shell_parse_argv(line, &line_argc, &line_argv, &error)) {
+            // Give the line an argv[0] so it goes through the same parser as the CLI.
+            gchar **argv = g_new0(gchar *, line_argc + 2);
+            argv[0] = (gchar *)"gamma-tool";
+            memcpy(argv + 1, line_argv, line_argc * sizeof(gchar *));
+            AppArgs line_args;
+            if (parse_arguments(line_argc + 1, argv, &line_args, &error)) {
+                func(&line_args, line_number, user_data, &error);
+            } else if (!error) {
+                g_set_error_literal(&error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "No command given.");
+            }
+            g_free(argv);
+            g_strfreev(line_argv);
+        }
+        if (error) {
+            fprintf(stderr, "Error: %s:%u: %s\n", path, line_number, error->message);
+            g_error_free(error);
+            *ok = FALSE;
+        }
+    }
+    free(line);
+    if (input != stdin) fclose(input);
+    return TRUE;
+}
+
+typedef struct {
+    GHashTable *bases;
+    GHashTable *templates;
+    const AppArgs *args;  // The --generate-batch invocation's own arguments
+} GenerateBatch;
+
+static gboolean generate_batch_line(AppArgs *line_args, guint line_number, gpointer user_data, GError **error) {
+    GenerateBatch *batch = user_data;
+    if (!line_args->generate_base) line_args->generate_base = batch->args->generate_base;
+    if (!line_args->generate_base) {
+        g_set_error_literal(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "No --generate base profile given.");
+        return FALSE;
+    }
+    return generate_one(batch->bases, batch->templates, line_args, error);
+}
+
+/**
+ * @brief Runs every line of a --generate-batch file in this one process.
+ *
+ * Each line holds the same options as the command line, and a line without
+ * --generate uses the base given alongside --generate-batch. A failing line
+ * is reported and the rest still run.
+ */
+static gboolean generate_batch(GHashTable *bases, GHashTable *templates, const AppArgs *args) {
+    GenerateBatch batch = { .bases = bases, .templates = templates, .args = args };
+    gboolean ok = TRUE;
+    return batch_foreach_line(args->generate_batch, generate_batch_line, &batch, &ok) && ok;
+}
+
+/**
+ * @brief Entry point for offline generation; never talks to colord or D-Bus.
+ * @return The process exit status.
+ */
+static int run_generate(const AppArgs *args) {
+    GHashTable *bases = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
+    GHashTable *templates = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)icc_template_free);
+    gboolean ok;
+    if (args->generate_batch) {
+        ok = generate_batch(bases, templates, args);
+    } else {
+        GError *error = NULL;
+        ok = generate_one(bases, templates, args, &error);
+        if (!ok) {
+            fprintf(stderr, "Error: %s\n", error->message);
+            g_error_free(error);
+        }
+    }
+    g_hash_table_unref(templates);
+    g_hash_table_unref(bases);
+    return ok ? 0 : 1;
+}
+
+// --- Batch mode: --batch FILE|- ---
+
+typedef struct {
+    AppArgs args;
+    guint line_number;
+} BatchCommand;
+
+/**
+ * @brief Returns TRUE if the request writes a profile.
+ */
+static gboolean args_is_apply(const AppArgs *args) {
+    return !args->remove_profile && !args->info_mode && !args->gc_mode && !args->direct;
+}
+
+/**
+ * @brief Returns TRUE if running `later` right after `earlier` leaves no trace of `earlier`.
+ *
+ * That is the case when both set the gamma (a --direct ramp is replaced too)
+ * and `later` names every display `earlier` named, or both target all displays.
+ * A skipped line's -d values must come back in `later`, so a display that
+ * doesn't exist is still reported, just once.
+ */
+static gboolean batch_supersedes(const AppArgs *later, const AppArgs *earlier) {
+    if (!args_is_apply(later) || !(args_is_apply(earlier) || earlier->direct) || args_is_relative(later)) {
+        return FALSE; // A relative change builds on the earlier one
+    }
+    if (later->n_scopes == 0 || earlier->n_scopes == 0) {
+        return later->n_scopes == earlier->n_scopes; // All displays, twice
+    }
+    for (guint i = 0; i < earlier->n_scopes; i++) {
+        const DeviceSettings *display = &earlier->scopes[i];
+        gboolean covered = FALSE;
+        for (guint j = 0; j < later->n_scopes && !covered; j++) {
+            covered = later->scopes[j].device_index == display->device_index &&
+                      g_strcmp0(later->scopes[j].device_name, display->device_name) == 0;
+        }
+        if (!covered) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static gboolean batch_read_line(AppArgs *line_args, guint line_number, gpointer user_data, GError **error) {
+    GArray *commands = user_data;
+    if (line_args->daemon_mode || line_args->batch || line_args->generate_base || line_args->generate_batch ||
+        line_args->temperature_end > 0) {
+        // These keep running or don't use colord; a batch is a plain sequence of changes.
+        g_set_error_literal(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                            "--daemon, --watch, --batch, --generate and transitions can't be batched.");
+        return FALSE;
+    }
+    BatchCommand command = { .args = *line_args, .line_number = line_number };
+    g_array_append_val(commands, command);
+    return TRUE;
+}
+
+/**
+ * @brief Reads and parses every command of a batch before anything is run.
+ * @return The commands, or NULL if the input couldn't be read. Lines that
+ *         don't parse are reported and clear *ok.
+ */
+static GArray *batch_read(const char *path, gboolean *ok) {
+    GArray *commands = g_array_new(FALSE, FALSE, sizeof(BatchCommand));
+    if (!batch_foreach_line(path, batch_read_line, commands, ok)) {
+        g_array_unref(commands);
+        return NULL;
+    }
+    return commands;
+}
+
+/**
+ * @brief Runs a batch of commands, one after another, against a single session.
+ *
+ * The device list is enumerated once and shared by every command, and a
+ * change that the next command overwrites anyway (e.g. two applies to the
+ * same display in a row) is skipped, so only the final state is written.
+ * @return The process exit status: 1 if any line failed to parse or run.
+ */
+static int run_batch(Session *session, const AppArgs *args, GMainLoop *loop) {
+    gboolean ok = TRUE;
+    GArray *commands = batch_read(args->batch, &ok);
+    if (!commands) {
+        return 1;
+    }
+    session_get_devices(session);
+    for (guint i = 0; i < commands->len; i++) {
+        BatchCommand *command = &g_array_index(commands, BatchCommand, i);
+        if (i + 1 < commands->len) {
+            BatchCommand *next = &g_array_index(commands, BatchCommand, i + 1);
+            if (batch_supersedes(&next->args, &command->args)) {
+                printf("Line %u: superseded by line %u, skipped.\n", command->line_number, next->line_number);
+                continue;
+            }
+        }
+        RunContext *run = run_new(session, &command->args, on_cli_run_done, loop);
+        run_start(run);
+        if (run->pending > 0) {
+            g_main_loop_run(loop);
+        }
+        gchar *output = run_get_output(run);
+        fputs(output, stdout);
+        fputs(run->errors->str, stderr);
+        fflush(stdout);
+        if (run->status != 0) {
+            ok = FALSE;
+        }
+        g_free(output);
+        run_free(run);
+    }
+    g_array_unref(commands);
+    return ok ? 0 : 1;
+}
+
+// --- Schedule: --daemon --schedule ---
+
+/**
+ * @brief Parses a --location LAT:LON pair in degrees, north and east positive.
+ */
+static gboolean schedule_parse_location(const char *str, gdouble *latitude, gdouble *longitude) {
+    gchar *end;
+    *latitude = g_ascii_strtod(str, &end);
+    if (end == str || *end != ':') {
+        return FALSE;
+    }
+    const char *longitude_str = end + 1;
+    *longitude = g_ascii_strtod(longitude_str, &end);
+    return end != longitude_str && *end == '\0' && fabs(*latitude) <= 90.0 && fabs(*longitude) <= 180.0;
+}
+
+/**
+ * @brief Parses the time part of a --schedule entry: HH:MM, or sunrise/sunset with an optional +/- offset.
+ */
+static gboolean schedule_parse_when(const char *when, ScheduleEvent *event) {
+    if (g_str_has_prefix(when, "sunrise") || g_str_has_prefix(when, "sunset")) {
+        event->kind = g_str_has_prefix(when, "sunrise") ? SCHEDULE_SUNRISE : SCHEDULE_SUNSET;
+        const char *offset = when + (event->kind == SCHEDULE_SUNRISE ? 7 : 6); // Skip "sunrise"/"sunset"
+        guint seconds = 0;
+        if (*offset != '\0' && ((*offset != '+' && *offset != '-') || !parse_duration(offset + 1, &seconds))) {
+            return FALSE;
+        }
+        event->seconds = *offset == '-' ? -(gint)seconds : (gint)seconds;
+        return TRUE;
+    }
+    int hour, minute;
+    char extra;
+    if (sscanf(when, "%d:%d%c", &hour, &minute, &extra) != 2 || hour < 0 || hour > 23 || minute < 0 || minute > 59) {
+        return FALSE;
+    }
+    event->kind = SCHEDULE_TIME;
+    event->seconds = hour * 3600 + minute * 60;
+    return TRUE;
+}
+
+/**
+ * @brief Parses a --schedule SPEC such as "07:00=6500,sunset-30m=4500,sunset=3400".
+ * @return An array of ScheduleEvent, or NULL with error set.
+ */
+static GArray *schedule_parse(const char *spec, gboolean have_location, GError **error) {
+    GArray *schedule = g_array_new(FALSE, FALSE, sizeof(ScheduleEvent));
+    gchar **entries = g_strsplit_set(spec, ", ", -1);
+    for (gchar **entry = entries; *entry; entry++) {
+        if (**entry == '\0') {
+            continue;
+        }
+        ScheduleEvent event;
+        const char *value = strchr(*entry, '=');
+        gchar *when = value ? g_strndup(*entry, value - *entry) : NULL;
+        gboolean ok = when && schedule_parse_when(when, &event);
+        g_free(when);
+        event.temperature = value ? atoi(value + 1) : 0;
+        if (!ok || event.temperature <= 0) {
+            g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                        "Invalid schedule entry '%s', expected WHEN=TEMP such as 07:30=6500 or sunset-30m=4500.", *entry);
+        } else if (event.kind != SCHEDULE_TIME && !have_location) {
+            g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "sunrise and sunset need --location LAT:LON.");
+        } else {
+            g_array_append_val(schedule, event);
+            continue;
+        }
+        g_strfreev(entries);
+        g_array_unref(schedule);
+        return NULL;
+    }
+    g_strfreev(entries);
+    if (schedule->len == 0) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "The schedule is empty.");
+        g_array_unref(schedule);
+        return NULL;
+    }
+    return schedule;
+}
+
+/**
+ * @brief Computes sunrise or sunset with the sunrise equation NOAA's calculator is based on.
+ *
+ * Good to a minute or two away from the poles, which is plenty for a
+ * temperature change.
+ * @param noon Local noon of the day, as a Unix time.
+ * @return FALSE if the sun doesn't rise or set that day (polar day or night).
+ */
+static gboolean solar_event_time(gint64 noon, gdouble latitude, gdouble longitude, gboolean sunrise, gint64 *when) {
+    const gdouble rad = G_PI / 180.0;
+    gdouble day = round(noon / 86400.0 + 2440587.5 - 2451545.0); // Days since J2000
+    gdouble mean_noon = day - longitude / 360.0;
+    gdouble anomaly = fmod(357.5291 + 0.98560028 * mean_noon, 360.0);
+    gdouble center = 1.9148 * sin(anomaly * rad) + 0.0200 * sin(2 * anomaly * rad) + 0.0003 * sin(3 * anomaly * rad);
+    gdouble ecliptic = fmod(anomaly + center + 180.0 + 102.9372, 360.0);
+    gdouble transit = 2451545.0 + mean_noon + 0.0053 * sin(anomaly * rad) - 0.0069 * sin(2 * ecliptic * rad);
+    gdouble sin_declination = sin(ecliptic * rad) * sin(23.4397 * rad);
+    gdouble cos_declination = sqrt(1.0 - sin_declination * sin_declination);
+    gdouble cos_hour_angle = (sin(-0.833 * rad) - sin(latitude * rad) * sin_declination) /
+                             (cos(latitude * rad) * cos_declination);
+    if (cos_hour_angle < -1.0 || cos_hour_angle > 1.0) {
+        return FALSE;
+    }
+    gdouble hour_angle = acos(cos_hour_angle) / rad;
+    gdouble julian = transit + (sunrise ? -hour_angle : hour_angle) / 360.0;
+    *when = (gint64)llround((julian - 2440587.5) * 86400.0);
+    return TRUE;
+}
+
+/**
+ * @brief Returns when an event happens on a given local day, as a Unix time.
+ * @return FALSE for a sunrise or sunset that doesn't happen that day.
+ */
+static gboolean schedule_event_time(const Daemon *daemon, const ScheduleEvent *event, GDateTime *day, gint64 *when) {
+    gint year, month, mday;
+    g_date_time_get_ymd(day, &year, &month, &mday);
+    if (event->kind == SCHEDULE_TIME) {
+        // Built from the fields rather than midnight + seconds, so DST changes are honored.
+        GDateTime *time = g_date_time_new_local(year, month, mday, event->seconds / 3600, event->seconds / 60 % 60, 0);
+        *when = g_date_time_to_unix(time);
+        g_date_time_unref(time);
+        return TRUE;
+    }
+    GDateTime *noon = g_date_time_new_local(year, month, mday, 12, 0, 0);
+    gboolean found = solar_event_time(g_date_time_to_unix(noon), daemon->latitude, daemon->longitude,
+                                      event->kind == SCHEDULE_SUNRISE, when);
+    g_date_time_unref(noon);
+    *when += event->seconds;
+    return found;
+}
+
+typedef struct {
+    gint64 when;
+    gint temperature;
+} ScheduledChange;
+
+static gint scheduled_change_compare(gconstpointer a, gconstpointer b) {
+    gint64 when_a = ((const ScheduledChange *)a)->when, when_b = ((const ScheduledChange *)b)->when;
+    return when_a < when_b ? -1 : when_a > when_b;
+}
+
+/**
+ * @brief Finds the temperature in effect at `now` and the next time it changes.
+ *
+ * Events less than SCHEDULE_COALESCE_SECONDS apart are folded into one
+ * wakeup at the last of them, so e.g. "sunset-1m" and "sunset" wake the
+ * machine once.
+ * @param temperature (Output) The temperature of the latest event at or before now.
+ * @param next (Output) Unix time of the next wakeup.
+ */
+static void schedule_lookup(const Daemon *daemon, gint64 now, gint *temperature, gint64 *next) {
+    GArray *changes = g_array_new(FALSE, FALSE, sizeof(ScheduledChange));
+    GDateTime *today = g_date_time_new_from_unix_local(now);
+    // Yesterday's events give the current state just after midnight, and the
+    // following days cover a schedule whose next event is later than tomorrow's first.
+    for (gint offset = -1; offset <= 2; offset++) {
+        GDateTime *day = g_date_time_add_days(today, offset);
+        for (guint i = 0; i < daemon->schedule->len; i++) {
+            const ScheduleEvent *event = &g_array_index(daemon->schedule, ScheduleEvent, i);
+            ScheduledChange change = { .temperature = event->temperature };
+            if (schedule_event_time(daemon, event, day, &change.when)) {
+                g_array_append_val(changes, change);
+            }
+        }
+        g_date_time_unref(day);
+    }
+    g_date_time_unref(today);
+    g_array_sort(changes, scheduled_change_compare);
+
+    *temperature = 0;
+    *next = now + SCHEDULE_RECHECK_SECONDS; // Nothing found, e.g. no sunset in a polar summer
+    for (guint i = 0; i < changes->len; i++) {
+        ScheduledChange *change = &g_array_index(changes, ScheduledChange, i);
+        if (change->when <= now) {
+            *temperature = change->temperature;
+            continue;
+        }
+        while (i + 1 < changes->len &&
+               g_array_index(changes, ScheduledChange, i + 1).when - change->when <= SCHEDULE_COALESCE_SECONDS) {
+            change = &g_array_index(changes, ScheduledChange, ++i);
+        }
+        *next = change->when;
+        break;
+    }
+    g_array_unref(changes);
+}
+
+// --- Daemon mode ---
+
+static void daemon_start_next(Daemon *daemon);
+
+static void daemon_note_targets(Daemon *daemon, RunContext *run);
+
+static void on_daemon_run_done(RunContext *run, gpointer user_data) {
+    Daemon *daemon = user_data;
+    if (daemon->current_is_internal) {
+        // Nobody is waiting for a commit or a scheduled change; its output only goes to the journal.
+        if (run->status != 0) {
+            g_warning("Internal run failed: %s", run->errors->str);
+        } else {
+            g_debug("Internal run finished: %s", run->errors->str);
+        }
+        daemon->current_is_internal = FALSE;
+        if (daemon->quitting) g_main_loop_quit(daemon->loop);
+    } else {
+        GDBusMethodInvocation *invocation = g_queue_pop_head(&daemon->requests);
+        gchar *output = run_get_output(run);
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(iss)", run->status, output, run->errors->str));
+        g_free(output);
+    }
+    if (daemon->watch_targets && args_is_apply(&run->args) && !run->prepare_failed) {
+        daemon_note_targets(daemon, run);
+    }
+    daemon->current = NULL;
+    if (daemon->metrics) {
+        stats_write_textfile(&daemon->session->stats, daemon->metrics);
+    }
+    // The finishing job is still on the stack, so free the run from an idle.
+    g_idle_add(run_free_idle, run);
+    daemon_start_next(daemon);
+}
+
+static gboolean on_daemon_commit_timeout(gpointer user_data) {
+    Daemon *daemon = user_data;
+    daemon->commit_id = 0;
+    daemon->commit_due = TRUE;
+    daemon_start_next(daemon);
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Tracks --direct requests so the last one is saved to colord once they stop.
+ *
+ * Every --direct request restarts the timer, so dragging a slider only commits
+ * a profile for the final value. Any other request that changes the display
+ * overrides the direct settings and cancels the commit.
+ */
+static void daemon_schedule_commit(Daemon *daemon, const AppArgs *args) {
+    if (args->info_mode) {
+        return;
+    }
+    if (daemon->commit_id) {
+        g_source_remove(daemon->commit_id);
+        daemon->commit_id = 0;
+    }
+    daemon->commit_due = FALSE;
+    if (args->direct && !args->no_persist) {
+        daemon->commit_args = *args;
+        daemon->commit_args.direct = FALSE;
+        daemon->commit_args.timings = TIMINGS_NONE;
+        // The deltas were applied already; a zero delta starts from, and so
+        // saves, what the direct request left on each display.
+        AppArgs *commit = &daemon->commit_args;
+        if (commit->gamma_relative) memset(commit->gamma, 0, sizeof(commit->gamma));
+        if (commit->temperature_relative) commit->temperature = 0;
+        for (guint i = 0; i < commit->n_scopes; i++) {
+            if (commit->scopes[i].gamma_relative) memset(commit->scopes[i].gamma, 0, sizeof(commit->scopes[i].gamma));
+            if (commit->scopes[i].temperature_relative) commit->scopes[i].temperature = 0;
+        }
+        daemon->commit_id = g_timeout_add(DIRECT_COMMIT_DELAY_MS, on_daemon_commit_timeout, daemon);
+    }
+}
+
+/**
+ * @brief Returns the daemon's command line settings as the arguments of an internal run.
+ */
+static AppArgs daemon_internal_args(const AppArgs *args) {
+    AppArgs internal = *args;
+    internal.daemon_mode = FALSE;
+    internal.watch = FALSE;
+    internal.schedule = NULL;
+    internal.location = NULL;
+    internal.timings = TIMINGS_NONE;
+    return internal;
+}
+
+/**
+ * @brief Remembers the settings of a request that changed every display, for --watch.
+ */
+static void daemon_note_settings(Daemon *daemon, const AppArgs *args) {
+    // A delta means nothing to a display that was just plugged in.
+    if (args->info_mode || args->gc_mode || args->n_scopes > 0 || args_is_relative(args)) {
+        return;
+    }
+    if (args->remove_profile) {
+        daemon->have_settings = FALSE;
+    } else if (!args->direct || !args->no_persist) {
+        daemon->settings = *args;
+        daemon->settings.direct = FALSE;
+        daemon->settings.timings = TIMINGS_NONE;
+        daemon->have_settings = TRUE;
+        if (daemon->watch_targets) g_hash_table_remove_all(daemon->watch_targets);
+    }
+}
+
+/**
+ * @brief Remembers what an apply run set on each display it changed, for --watch.
+ *
+ * A per-display or relative request leaves those displays at something other
+ * than the daemon's settings; the device-changed it causes mustn't undo it.
+ */
+static void daemon_note_targets(Daemon *daemon, RunContext *run) {
+    for (guint i = 0; i < run->jobs->len; i++) {
+        DeviceJob *job = g_ptr_array_index(run->jobs, i);
+        if (!job->prepared) {
+            continue;
+        }
+        WatchTarget *target = g_new(WatchTarget, 1);
+        memcpy(target->gamma, job->args.gamma, sizeof(target->gamma));
+        target->temperature = job->args.temperature;
+        g_hash_table_replace(daemon->watch_targets, g_strdup(cd_device_get_id(job->device)), target);
+    }
+}
+
+/**
+ * @brief Returns TRUE unless the device's default profile already has the display's target settings.
+ *
+ * The target is what the last run that changed the display applied, or the
+ * daemon's settings if they changed since. Our own changes emit
+ * device-changed too, and match; a display that was unplugged while the
+ * settings (e.g. the schedule) changed doesn't, and is brought up to date.
+ */
+static gboolean watch_device_needs_apply(Daemon *daemon, CdDevice *device) {
+    Session *session = daemon->session;
+    gboolean needs_apply = TRUE;
+    GPtrArray *profiles = cd_device_get_profiles(device);
+    CdProfile *current = profiles && profiles->len > 0 ? g_ptr_array_index(profiles, 0) : NULL;
+    CdProfile *cached = current ? g_hash_table_lookup(session->profiles, cd_profile_get_object_path(current)) : NULL;
+    if (!cached && current && cd_profile_connect_sync(current, NULL, NULL)) {
+        session_cache_profile(session, current);
+        cached = current;
+    }
+    gfloat gamma[3];
+    gint temperature;
+    guint n_samples;
+    if (cached && is_gamma_tool_profile(cached) && profile_get_settings(cached, gamma, &temperature, &n_samples)) {
+        const WatchTarget *target = g_hash_table_lookup(daemon->watch_targets, cd_device_get_id(device));
+        const gfloat *target_gamma = target ? target->gamma : daemon->settings.gamma;
+        gint target_temperature = target ? target->temperature : daemon->settings.temperature;
+        needs_apply = gamma[0] != target_gamma[0] || gamma[1] != target_gamma[1] ||
+                      gamma[2] != target_gamma[2] || temperature != target_temperature;
+    }
+    if (profiles) g_ptr_array_free(profiles, TRUE);
+    return needs_apply;
+}
+
+/**
+ * @brief Starts a run over the displays that were plugged in or changed, if any need it.
+ */
+static void daemon_start_watch_run(Daemon *daemon) {
+    daemon->watch_due = FALSE;
+    GPtrArray *devices = g_ptr_array_new_with_free_func(g_object_unref);
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, daemon->watch_pending);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        CdDevice *device = value;
+        GError *error = NULL;
+        if (!cd_device_connect_sync(device, NULL, &error)) {
+            g_warning("Could not connect to device %s: %s", cd_device_get_object_path(device), error->message);
+            g_error_free(error);
+            continue;
+        }
+        if (cd_device_get_kind(device) == CD_DEVICE_KIND_DISPLAY &&
+            watch_device_needs_apply(daemon, device)) {
+            g_ptr_array_add(devices, g_object_ref(device));
+        }
+    }
+    g_hash_table_remove_all(daemon->watch_pending);
+    if (devices->len == 0 || !daemon->have_settings) {
+        g_ptr_array_unref(devices);
+        return;
+    }
+    daemon->current_is_internal = TRUE;
+    daemon->current = run_new(daemon->session, &daemon->settings, on_daemon_run_done, daemon);
+    daemon->current->devices = devices;
+    run_start(daemon->current);
+}
+
+static gboolean on_watch_debounce(gpointer user_data) {
+    Daemon *daemon = user_data;
+    daemon->watch_id = 0;
+    daemon->watch_due = TRUE;
+    daemon_start_next(daemon);
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Collects hotplug events; a dock adds several displays in a burst, so
+ *        they are handled together once WATCH_DEBOUNCE_MS pass without another.
+ */
+static void on_watch_device_event(CdClient *client, CdDevice *device, gpointer user_data) {
+    Daemon *daemon = user_data;
+    if (!daemon->have_settings) {
+        return;
+    }
+    g_hash_table_replace(daemon->watch_pending, g_strdup(cd_device_get_object_path(device)), g_object_ref(device));
+    if (daemon->watch_id) {
+        g_source_remove(daemon->watch_id);
+    }
+    daemon->watch_id = g_timeout_add(WATCH_DEBOUNCE_MS, on_watch_debounce, daemon);
+}
+
+static void on_watch_device_removed(CdClient *client, CdDevice *device, gpointer user_data) {
+    Daemon *daemon = user_data;
+    g_hash_table_remove(daemon->watch_pending, cd_device_get_object_path(device));
+}
+
+/**
+ * @brief Sets up --watch: applies the daemon's settings, if any, and subscribes to hotplug events.
+ */
+static void daemon_start_watch(Daemon *daemon, const AppArgs *args) {
+    daemon->watch_pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
+    daemon->watch_targets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    if (!daemon->have_settings && (args->gamma[0] != 1.0f || args->gamma[1] != 1.0f || args->gamma[2] != 1.0f ||
+                                   args->temperature != 6500)) {
+        daemon->settings = daemon_internal_args(args);
+        daemon->have_settings = TRUE;
+        // Bring the displays that are already connected in line first.
+        for (GList *l = session_get_devices(daemon->session); l != NULL; l = l->next) {
+            g_hash_table_replace(daemon->watch_pending, g_strdup(cd_device_get_object_path(l->data)),
+                                 g_object_ref(l->data));
+        }
+        daemon->watch_due = TRUE;
+        daemon_start_next(daemon);
+    }
+    g_signal_connect(daemon->session->client, "device-added", G_CALLBACK(on_watch_device_event), daemon);
+    g_signal_connect(daemon->session->client, "device-changed", G_CALLBACK(on_watch_device_event), daemon);
+    g_signal_connect(daemon->session->client, "device-removed", G_CALLBACK(on_watch_device_removed), daemon);
+}
+
+/**
+ * @brief Starts the request at the head of the queue, unless one is already running.
+ *
+ * Internal work comes first: a due --direct commit, then a scheduled change,
+ * then displays --watch saw being plugged in.
+ */
+static void daemon_start_next(Daemon *daemon) {
+    if (daemon->current == NULL && (daemon->commit_due || daemon->schedule_due)) {
+        const AppArgs *args = daemon->commit_due ? &daemon->commit_args : &daemon->schedule_args;
+        if (daemon->commit_due) {
+            daemon->commit_due = FALSE;
+        } else {
+            daemon->schedule_due = FALSE;
+        }
+        daemon->current_is_internal = TRUE;
+        daemon->current = run_new(daemon->session, args, on_daemon_run_done, daemon);
+        run_start(daemon->current);
+    }
+    if (daemon->current == NULL && daemon->watch_due) {
+        daemon_start_watch_run(daemon);
+    }
+    while (daemon->current == NULL && !g_queue_is_empty(&daemon->requests)) {
+        GDBusMethodInvocation *invocation = g_queue_peek_head(&daemon->requests);
+        const gchar **arguments = NULL;
+        g_variant_get(g_dbus_method_invocation_get_parameters(invocation), "(^a&s)", &arguments);
+
+        // Rebuild an argv so requests go through the same parser as the CLI.
+        guint n_arguments = g_strv_length((gchar **)arguments);
+        gchar **argv = g_new0(gchar *, n_arguments + 2);
+        argv[0] = (gchar *)"gamma-tool";
+        for (guint i = 0; i < n_arguments; i++) {
+            argv[i + 1] = (gchar *)arguments[i];
+        }
+        AppArgs args;
+        GError *error = NULL;
+        gboolean ok = parse_arguments(n_arguments + 1, argv, &args, &error);
+        g_free(argv);
+        g_free(arguments);
+        if (!ok || args.daemon_mode || args.generate_base || args.generate_batch || args.temperature_end > 0 ||
+            args.batch) {
+            g_queue_pop_head(&daemon->requests);
+            g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS, "%s",
+                                                  error ? error->message : "Invalid request");
+            g_clear_error(&error);
+            continue;
+        }
+        daemon_schedule_commit(daemon, &args);
+        daemon_note_settings(daemon, &args);
+        daemon->current = run_new(daemon->session, &args, on_daemon_run_done, daemon);
+        run_start(daemon->current);
+    }
+}
+
+static void daemon_arm_schedule(Daemon *daemon, gint64 next);
+
+/**
+ * @brief Applies the scheduled temperature in effect now and sleeps until the next change.
+ *
+ * A scheduled change is newer than any --direct settings still waiting to be
+ * committed, so it replaces them.
+ */
+static void daemon_apply_schedule(Daemon *daemon) {
+    gint temperature;
+    gint64 next;
+    schedule_lookup(daemon, g_get_real_time() / G_USEC_PER_SEC, &temperature, &next);
+    if (temperature > 0) {
+        if (daemon->commit_id) {
+            g_source_remove(daemon->commit_id);
+            daemon->commit_id = 0;
+        }
+        daemon->commit_due = FALSE;
+        daemon->schedule_args.temperature = temperature;
+        for (guint i = 0; i < daemon->schedule_args.n_scopes; i++) {
+            daemon->schedule_args.scopes[i].temperature = temperature;
+        }
+        daemon->schedule_due = TRUE;
+        daemon->settings = daemon->schedule_args;
+        daemon->have_settings = TRUE;
+        if (daemon->watch_targets) g_hash_table_remove_all(daemon->watch_targets);
+        daemon_start_next(daemon);
+    }
+    daemon_arm_schedule(daemon, next);
+}
+
+static gboolean on_schedule_timer_fd(gint fd, GIOCondition condition, gpointer user_data) {
+    Daemon *daemon = user_data;
+    guint64 expirations;
+    // ECANCELED means the wall clock was set; the schedule is re-evaluated either way.
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != ECANCELED && errno != EAGAIN) {
+        g_warning("Could not read the schedule timer: %s", g_strerror(errno));
+    }
+    daemon_apply_schedule(daemon);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_schedule_timeout(gpointer user_data) {
+    Daemon *daemon = user_data;
+    daemon->timer_id = 0;
+    daemon_apply_schedule(daemon);
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Sets the one schedule timer to fire at `next`, a Unix time.
+ *
+ * The timerfd runs on CLOCK_REALTIME with an absolute expiry, so it fires
+ * right after a resume that slept through an event, and wakes up early if the
+ * clock or time zone is changed. The daemon sleeps in poll() in between.
+ */
+static void daemon_arm_schedule(Daemon *daemon, gint64 next) {
+    if (daemon->timer_fd >= 0) {
+        struct itimerspec spec = { .it_value = { .tv_sec = next } };
+        if (timerfd_settime(daemon->timer_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, NULL) == 0) {
+            return;
+        }
+        g_warning("Could not set the schedule timer: %s", g_strerror(errno));
+    }
+    if (daemon->timer_id == 0) {
+        gint64 delay = MAX(next - g_get_real_time() / G_USEC_PER_SEC, 1);
+        daemon->timer_id = g_timeout_add_seconds(MIN(delay, SCHEDULE_RECHECK_SECONDS), on_schedule_timeout, daemon);
+    }
+}
+
+/**
+ * @brief Sets up --schedule: applies the current temperature and arms the timer.
+ * @return FALSE if the schedule or location is invalid (error is set).
+ */
+static gboolean daemon_start_schedule(Daemon *daemon, const AppArgs *args, GError **error) {
+    if (args->location && !schedule_parse_location(args->location, &daemon->latitude, &daemon->longitude)) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                    "Invalid location '%s', expected LAT:LON in degrees, e.g. 52.52:13.40.", args->location);
+        return FALSE;
+    }
+    daemon->schedule = schedule_parse(args->schedule, args->location != NULL, error);
+    if (!daemon->schedule) {
+        return FALSE;
+    }
+    // Scheduled changes use the daemon's own -d, -g, -n and --slots.
+    daemon->schedule_args = daemon_internal_args(args);
+
+    daemon->timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (daemon->timer_fd >= 0) {
+        daemon->timer_id = g_unix_fd_add(daemon->timer_fd, G_IO_IN, on_schedule_timer_fd, daemon);
+    } else {
+        g_warning("No timerfd (%s), the schedule won't notice clock changes.", g_strerror(errno));
+    }
+    daemon_apply_schedule(daemon);
+    return TRUE;
+}
+
+static void on_daemon_method_call(GDBusConnection *connection, const gchar *sender, const gchar *object_path,
+                                  const gchar *interface_name, const gchar *method_name, GVariant *parameters,
+                                  GDBusMethodInvocation *invocation, gpointer user_data) {
+    Daemon *daemon = user_data;
+    if (g_strcmp0(method_name, "Run") == 0) {
+        g_queue_push_tail(&daemon->requests, invocation);
+        daemon_start_next(daemon);
+    } else {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
+                                              "Unknown method %s", method_name);
+    }
+}
+
+static GVariant *on_daemon_get_property(GDBusConnection *connection, const gchar *sender, const gchar *object_path,
+                                        const gchar *interface_name, const gchar *property_name, GError **error,
+                                        gpointer user_data) {
+    Daemon *daemon = user_data;
+    GVariantBuilder dict;
+    g_variant_builder_init(&dict, G_VARIANT_TYPE("a{sd}"));
+    stats_render(&daemon->session->stats, NULL, &dict);
+    return g_variant_builder_end(&dict);
+}
+
+static const GDBusInterfaceVTable daemon_vtable = {
+    .method_call = on_daemon_method_call,
+    .get_property = on_daemon_get_property,
+};
+
+static void on_daemon_bus_acquired(GDBusConnection *connection, const gchar *name, gpointer user_data) {
+    Daemon *daemon = user_data;
+    GError *error = NULL;
+    if (!g_dbus_connection_register_object(connection, DAEMON_OBJECT_PATH, daemon->introspection->interfaces[0],
+                                           &daemon_vtable, daemon, NULL, &error)) {
+        g_critical("Could not export the daemon interface: %s", error->message);
+        g_error_free(error);
+        g_main_loop_quit(daemon->loop);
+    }
+}
+
+static void on_daemon_name_lost(GDBusConnection *connection, const gchar *name, gpointer user_data) {
+    Daemon *daemon = user_data;
+    g_critical("Could not own %s on the session bus; is another daemon running?", name);
+    g_main_loop_quit(daemon->loop);
+}
+
+static gboolean on_daemon_signal(gpointer user_data) {
+    Daemon *daemon = user_data;
+    if (daemon->commit_id || daemon->current_is_internal) {
+        // Save pending --direct settings before going away.
+        if (daemon->commit_id) {
+            g_source_remove(daemon->commit_id);
+            daemon->commit_id = 0;
+            daemon->commit_due = TRUE;
+        }
+        daemon->quitting = TRUE;
+        daemon_start_next(daemon);
+        return G_SOURCE_REMOVE;
+    }
+    g_main_loop_quit(daemon->loop);
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Runs the --daemon main loop until SIGINT/SIGTERM or the bus name is lost.
+ *
+ * The colord connection, device list, connected profiles and parsed base ICC
+ * data stay cached in one session, so each request only pays for the work
+ * that actually changes the display.
+ */
+static int run_daemon(const AppArgs *args) {
+    GError *error = NULL;
+    Daemon daemon = { .timer_fd = -1, .metrics = args->metrics };
+    g_queue_init(&daemon.requests);
+    daemon.session = session_new(&error);
+    if (!daemon.session) {
+        g_critical("Failed to connect to colord: %s", error->message);
+        g_error_free(error);
+        return 1;
+    }
+    // Enumerate now so the first request is already warm.
+    session_get_devices(daemon.session);
+    if (daemon.metrics) {
+        stats_write_textfile(&daemon.session->stats, daemon.metrics);
+    }
+    if (args->schedule && !daemon_start_schedule(&daemon, args, &error)) {
+        fprintf(stderr, "Error: %s\n", error->message);
+        g_error_free(error);
+        session_free(daemon.session);
+        return 1;
+    }
+    if (args->watch) {
+        daemon_start_watch(&daemon, args);
+    }
+
+    daemon.introspection = g_dbus_node_info_new_for_xml(daemon_introspection_xml, NULL);
+    daemon.loop = g_main_loop_new(NULL, FALSE);
+    guint owner_id = g_bus_own_name(G_BUS_TYPE_SESSION, DAEMON_BUS_NAME, G_BUS_NAME_OWNER_FLAGS_DO_NOT_QUEUE,
+                                    on_daemon_bus_acquired, NULL, on_daemon_name_lost, &daemon, NULL);
+    g_unix_signal_add(SIGINT, on_daemon_signal, &daemon);
+    g_unix_signal_add(SIGTERM, on_daemon_signal, &daemon);
+    g_main_loop_run(daemon.loop);
+
+    g_bus_unown_name(owner_id);
+    if (daemon.timer_id) g_source_remove(daemon.timer_id);
+    if (daemon.timer_fd >= 0) close(daemon.timer_fd);
+    if (daemon.schedule) g_array_unref(daemon.schedule);
+    if (daemon.watch_id) g_source_remove(daemon.watch_id);
+    if (daemon.watch_pending) {
+        g_signal_handlers_disconnect_by_data(daemon.session->client, &daemon);
+        g_hash_table_unref(daemon.watch_pending);
+        g_hash_table_unref(daemon.watch_targets);
+    }
+    g_main_loop_unref(daemon.loop);
+    g_dbus_node_info_unref(daemon.introspection);
+    session_free(daemon.session);
+    return 0;
+}
+
+/**
+ * @brief Hands the command line to a running daemon, if there is one.
+ * @return TRUE if the daemon served the request (status is set), FALSE if the
+ *         caller should run it locally.
+ */
+static gboolean forward_to_daemon(int argc, char *argv[], gint *status) {
+    GDBusConnection *bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+    if (!bus) {
+        return FALSE;
+    }
+    GError *error = NULL;
+    GVariant *reply = g_dbus_connection_call_sync(bus, DAEMON_BUS_NAME, DAEMON_OBJECT_PATH, DAEMON_BUS_NAME, "Run",
+                                                  g_variant_new("(^as)", argv + 1), G_VARIANT_TYPE("(iss)"),
+                                                  G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, NULL, &error);
+    g_object_unref(bus);
+    if (!reply) {
+        if (!g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_SERVICE_UNKNOWN) &&
+            !g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_NAME_HAS_NO_OWNER)) {
+            g_warning("gamma-tool daemon failed, running locally: %s", error->message);
+        }
+        g_error_free(error);
+        return FALSE;
+    }
+    const gchar *output, *errors;
+    g_variant_get(reply, "(i&s&s)", status, &output, &errors);
+    fputs(output, stdout);
+    fputs(errors, stderr);
+    g_variant_unref(reply);
+    return TRUE;
+}
+
+// --- Library API (gammatool.h) ---
+GammaToolContext *gamma_tool_context_new(GError **error) {
+    gint64 connect_start = g_get_monotonic_time();
+    Session *session = session_new(error);
+    if (!session) {
         return NULL;
     }
-    if (!cd_profile_connect_sync(profile, NULL, &error)) {
-        g_warning("Could not connect to sRGB profile: %s", error->message);
-        g_error_free(error); g_object_unref(profile); return NULL;
+    GammaToolContext *context = g_new0(GammaToolContext, 1);
+    context->session = session;
+    g_queue_init(&context->tasks);
+    context->connect_start = connect_start;
+    context->connect_usec = g_get_monotonic_time() - connect_start;
+    return context;
+}
+
+void gamma_tool_context_free(GammaToolContext *context) {
+    session_free(context->session);
+    g_free(context);
+}
+
+gchar **gamma_tool_context_list_devices(GammaToolContext *context) {
+    GPtrArray *ids = g_ptr_array_new();
+    for (GList *l = session_get_devices(context->session); l; l = l->next) {
+        g_ptr_array_add(ids, g_strdup(cd_device_get_id(l->data)));
+    }
+    g_ptr_array_add(ids, NULL);
+    return (gchar **)g_ptr_array_free(ids, FALSE);
+}
+
+void gamma_tool_result_free(GammaToolResult *result) {
+    g_free(result->output);
+    g_free(result->errors);
+    g_free(result);
+}
+
+static void context_start_next(GammaToolContext *context);
+
+static void on_context_run_done(RunContext *run, gpointer user_data) {
+    GammaToolContext *context = user_data;
+    GTask *task = g_queue_pop_head(&context->tasks);
+    GammaToolResult *result = g_new0(GammaToolResult, 1);
+    result->status = run->status;
+    result->output = run_get_output(run);
+    result->errors = g_strdup(run->errors->str);
+    g_task_return_pointer(task, result, (GDestroyNotify)gamma_tool_result_free);
+    g_object_unref(task);
+    context->current = NULL;
+    g_idle_add(run_free_idle, run);
+    context_start_next(context);
+}
+
+/**
+ * @brief Starts the oldest queued request unless one is running, like daemon_start_next().
+ */
+static void context_start_next(GammaToolContext *context) {
+    while (context->current == NULL && !g_queue_is_empty(&context->tasks)) {
+        GTask *task = g_queue_peek_head(&context->tasks);
+        if (g_task_return_error_if_cancelled(task)) {
+            g_object_unref(g_queue_pop_head(&context->tasks));
+            continue;
+        }
+        context->current = run_new(context->session, g_task_get_task_data(task), on_context_run_done, context);
+        if (context->connect_start) {
+            // The first request pays for the connection, as a CLI run does.
+            context->current->start_time = context->connect_start;
+            run_add_timing(context->current, NULL, "colord-connect", context->connect_usec);
+            context->connect_start = 0;
+        }
+        run_start(context->current);
+    }
+}
+
+void gamma_tool_run_async(GammaToolContext *context, const gchar *const *options, GCancellable *cancellable,
+                          GAsyncReadyCallback callback, gpointer user_data) {
+    GTask *task = g_task_new(NULL, cancellable, callback, user_data);
+    g_task_set_source_tag(task, gamma_tool_run_async);
+
+    // Same parser as the CLI, so rebuild an argv with a program name.
+    guint n_options = g_strv_length((gchar **)options);
+    gchar **argv = g_new0(gchar *, n_options + 2);
+    argv[0] = (gchar *)"gamma-tool";
+    for (guint i = 0; i < n_options; i++) {
+        argv[i + 1] = (gchar *)options[i];
     }
-    if (!cd_device_add_profile_sync(device, CD_DEVICE_RELATION_HARD, profile, NULL, &error)) {
-        g_warning("Failed to add sRGB profile: %s", error->message);
-        g_error_free(error); g_object_unref(profile); return NULL;
+    AppArgs *args = g_new(AppArgs, 1);
+    GError *error = NULL;
+    gboolean ok = parse_arguments(n_options + 1, argv, args, &error);
+    g_free(argv);
+    // The rejected modes are the only ones whose fields point into argv.
+    if (ok && (args->daemon_mode || args->generate_base || args->generate_batch ||
+               args->temperature_end > 0 || args->batch)) {
+        g_set_error(&error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                    "--daemon, --watch, --batch, --generate and transitions are only available from the command line.");
+        ok = FALSE;
+    }
+    if (!ok) {
+        if (!error) {
+            g_set_error(&error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED, "No options given.");
+        }
+        g_free(args);
+        g_task_return_error(task, error);
+        g_object_unref(task);
+        return;
+    }
+    g_task_set_task_data(task, args, g_free);
+    g_queue_push_tail(&context->tasks, task);
+    context_start_next(context);
+}
+
+GammaToolResult *gamma_tool_run_finish(GammaToolContext *context, GAsyncResult *result, GError **error) {
+    g_return_val_if_fail(g_task_is_valid(result, NULL), NULL);
+    return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+typedef struct {
+    GMainLoop *loop;
+    GAsyncResult *result;
+} SyncWait;
+
+static void on_sync_run_done(GObject *source, GAsyncResult *res, gpointer user_data) {
+    SyncWait *wait = user_data;
+    wait->result = g_object_ref(res);
+    g_main_loop_quit(wait->loop);
+}
+
+GammaToolResult *gamma_tool_run_sync(GammaToolContext *context, const gchar *const *options,
+                                     GCancellable *cancellable, GError **error) {
+    SyncWait wait = {g_main_loop_new(g_main_context_get_thread_default(), FALSE), NULL};
+    gamma_tool_run_async(context, options, cancellable, on_sync_run_done, &wait);
+    if (!wait.result) {
+        g_main_loop_run(wait.loop);
     }
-    if (!cd_device_make_profile_default_sync(device, profile, NULL, &error)) {
-        g_warning("Failed to make sRGB profile default: %s", error->message);
-        g_error_free(error); g_object_unref(profile); return NULL;
+    g_main_loop_unref(wait.loop);
+    GammaToolResult *result = gamma_tool_run_finish(context, wait.result, error);
+    g_object_unref(wait.result);
+    return result;
+}
+
+guint16 *gamma_tool_compute_ramp(const gfloat gamma[3], gint temperature, guint n_samples) {
+    if (n_samples < 2 || n_samples > MAX_SAMPLES) {
+        return NULL;
     }
-    return profile;
+    VcgtRamp *ramp = vcgt_compute(gamma, temperature, n_samples);
+    guint16 *values = g_new(guint16, 3 * n_samples);
+    memcpy(values, ramp->data, 3 * n_samples * sizeof(guint16));
+    g_free(ramp);
+    return values;
 }
@@ -0,0 +1,80 @@
+// libgammatool: the gamma-tool logic, for programs that would rather link it
+// than run the binary. Build it with: make libgammatool.a
+//
+// A GammaToolContext holds what `gamma-tool --daemon` keeps warm: the colord
+// connection, the display devices, the connected profiles and the parsed base
+// profiles. Requests take the same options as the command line, without the
+// program name, e.g. {"-d", "DP-1", "-t", "5000", NULL}, and produce the same
+// output and status. They run one at a time, in the order they were made.
+//
+// --daemon, --watch, --schedule, --batch, --generate and transitions
+// (-t START..END) are CLI features and are rejected. The context doesn't save
+// --direct settings as a profile later the way the daemon does.
+//
+// The async functions run on the thread-default main context, which must be
+// the one the context was created on. Free the context only when no request
+// is pending.
+#ifndef GAMMATOOL_H
+#define GAMMATOOL_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GammaToolContext GammaToolContext;
+
+// The outcome of one request.
+typedef struct {
+    gint status;    // 0 on success, 1 if anything failed; the CLI's exit status
+    gchar *output;  // What the CLI prints on stdout
+    gchar *errors;  // What the CLI prints on stderr, including --timings
+} GammaToolResult;
+
+/**
+ * @brief Connects to colord.
+ * @return A new context, or NULL with error set.
+ */
+GammaToolContext *gamma_tool_context_new(GError **error);
+
+void gamma_tool_context_free(GammaToolContext *context);
+
+/**
+ * @brief Lists the colord IDs of the connected displays, in -d INDEX order.
+ * @return A NULL-terminated array; free it with g_strfreev().
+ */
+gchar **gamma_tool_context_list_devices(GammaToolContext *context);
+
+/**
+ * @brief Runs one request, iterating the thread-default main context until it is done.
+ * @return The result, or NULL with error set if the options are invalid or
+ *         the request was cancelled. Free it with gamma_tool_result_free().
+ */
+GammaToolResult *gamma_tool_run_sync(GammaToolContext *context, const gchar *const *options,
+                                     GCancellable *cancellable, GError **error);
+
+/**
+ * @brief Queues one request; callback is called once it has run.
+ *
+ * The options are parsed before this returns, so they needn't outlive the
+ * call. Cancelling only takes effect while the request is still queued.
+ */
+void gamma_tool_run_async(GammaToolContext *context, const gchar *const *options, GCancellable *cancellable,
+                          GAsyncReadyCallback callback, gpointer user_data);
+
+GammaToolResult *gamma_tool_run_finish(GammaToolContext *context, GAsyncResult *result, GError **error);
+
+void gamma_tool_result_free(GammaToolResult *result);
+
+/**
+ * @brief Computes the gamma ramp gamma-tool would use, without colord.
+ *
+ * Safe to call from several threads at once.
+ * @param n_samples Entries per channel, 2 to 65535.
+ * @return 3 * n_samples values, the red, green and blue ramps back to back,
+ *         or NULL if n_samples is out of range. Free with g_free().
+ */
+guint16 *gamma_tool_compute_ramp(const gfloat gamma[3], gint temperature, guint n_samples);
+
+G_END_DECLS
+
+#endif // GAMMATOOL_H